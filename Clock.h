@@ -0,0 +1,279 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_CLOCK_H
+#define CEPH_CLOCK_H
+
+#include <time.h>
+#include <stdint.h>
+#include "utime.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define CEPH_HAVE_TSC 1
+#endif
+
+// clock sources. realtime is wall clock time and can be stepped by
+// NTP; everything else only moves forward and is what deadlines and
+// rate computations should use. a manual clock only moves when it is
+// set, for tests and simulations that inject their own time.
+enum {
+  CEPH_CLOCK_REALTIME = 0,
+  CEPH_CLOCK_MONOTONIC,
+  CEPH_CLOCK_MONOTONIC_COARSE, // tick resolution, no syscall
+  CEPH_CLOCK_TSC,              // cycle counter, monotonic fallback
+  CEPH_CLOCK_MANUAL            // CachedClock::set(), monotonic until then
+};
+
+inline uint64_t ceph_clock_gettime_ns(clockid_t id) {
+  struct timespec tp;
+  clock_gettime(id, &tp);
+  return (uint64_t)tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+/*
+ * CLOCK_MONOTONIC extrapolated from the cycle counter. ns = base_ns +
+ * (tsc - base_tsc) * mult >> SHIFT. once per resync interval a reader
+ * compares against CLOCK_MONOTONIC and re-bases: the new base
+ * continues the old line, so time never jumps, and mult is set to the
+ * measured rate plus a slew that closes the error over the next
+ * interval. calibrations are double buffered: the resyncer fills the
+ * idle slot and then flips cur, and resyncs are far enough apart that
+ * no reader is still looking at a slot when it is reused.
+ *
+ * only used when the cpu advertises an invariant TSC; otherwise every
+ * read falls through to CLOCK_MONOTONIC.
+ */
+class TscClock {
+  enum { SHIFT = 24 };
+
+  struct Calibration {
+    uint64_t tsc, ns;
+    uint64_t mult;
+  };
+
+  Calibration cal[2];
+  volatile uint32_t cur;     // slot readers use
+  volatile uint32_t syncing; // one resyncer at a time
+  uint64_t sync_tsc, sync_ns; // last comparison against monotonic
+  uint64_t resync_ticks, resync_ns;
+  bool usable;
+
+  static uint64_t rdtsc() {
+#ifdef CEPH_HAVE_TSC
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+  static bool invariant_tsc() {
+#ifdef CEPH_HAVE_TSC
+    unsigned a, b, c, d;
+    if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007)
+      return false;
+    __get_cpuid(0x80000007, &a, &b, &c, &d);
+    return d & (1 << 8);
+#else
+    return false;
+#endif
+  }
+
+  // read tsc and monotonic as close together as we can: keep the
+  // tightest of a few tries, so an interrupt or a cold vdso page
+  // doesn't skew the pairing
+  static void sample(uint64_t *tsc, uint64_t *ns) {
+    uint64_t best = ~0ull;
+    *tsc = *ns = 0;
+    for (int i = 0; i < 5; i++) {
+      uint64_t t0 = rdtsc();
+      uint64_t n = ceph_clock_gettime_ns(CLOCK_MONOTONIC);
+      uint64_t t1 = rdtsc();
+      if (t1 - t0 < best) {
+	best = t1 - t0;
+	*tsc = t0 + (t1 - t0) / 2;
+	*ns = n;
+      }
+    }
+  }
+
+  // fields are copied with relaxed atomics; the acquire/release on
+  // cur is what orders them
+  Calibration read_cal() const {
+    const Calibration &s = cal[__atomic_load_n(&cur, __ATOMIC_ACQUIRE)];
+    Calibration c;
+    c.tsc = __atomic_load_n(&s.tsc, __ATOMIC_RELAXED);
+    c.ns = __atomic_load_n(&s.ns, __ATOMIC_RELAXED);
+    c.mult = __atomic_load_n(&s.mult, __ATOMIC_RELAXED);
+    return c;
+  }
+
+  void publish(const Calibration &c) {
+    uint32_t next = cur ^ 1;
+    __atomic_store_n(&cal[next].tsc, c.tsc, __ATOMIC_RELAXED);
+    __atomic_store_n(&cal[next].ns, c.ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&cal[next].mult, c.mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&cur, next, __ATOMIC_RELEASE);
+  }
+
+  static uint64_t extrapolate(const Calibration &c, uint64_t tsc) {
+    return c.ns + (uint64_t)(((unsigned __int128)(tsc - c.tsc) * c.mult) >> SHIFT);
+  }
+
+  void resync(const Calibration &c) {
+    if (!__sync_bool_compare_and_swap(&syncing, 0, 1))
+      return;
+    uint64_t tsc, mono;
+    sample(&tsc, &mono);
+    if (tsc - c.tsc >= resync_ticks && tsc > sync_tsc) {
+      uint64_t ns = extrapolate(c, tsc);
+      // measured rate, then slew toward monotonic by at most 10%.
+      // resyncs only happen on reads, so the interval is unbounded
+      // and the shifted ns would overflow 64 bits after ~18 minutes.
+      // err goes negative when the tsc runs fast, so it is scaled by
+      // multiplying: left shifting a negative value is undefined.
+      int64_t rate = (int64_t)(((unsigned __int128)(mono - sync_ns) << SHIFT)
+                               / (tsc - sync_tsc));
+      int64_t err = (int64_t)(mono - ns);
+      int64_t max_err = resync_ns / 10;
+      if (err > max_err)
+	err = max_err;
+      if (err < -max_err)
+	err = -max_err;
+      Calibration n;
+      n.tsc = tsc;
+      n.ns = ns;
+      n.mult = rate + err * ((int64_t)1 << SHIFT) / (int64_t)resync_ticks;
+      publish(n);
+      sync_tsc = tsc;
+      sync_ns = mono;
+    }
+    __sync_lock_release(&syncing);
+  }
+
+public:
+  explicit TscClock(uint64_t _resync_ns = 1000000000ull)
+    : cur(0), syncing(0), sync_tsc(0), sync_ns(0), resync_ticks(0),
+      resync_ns(_resync_ns), usable(false) {
+    cal[0].tsc = cal[0].ns = cal[0].mult = 0;
+    cal[1] = cal[0];
+    calibrate();
+  }
+
+  // measure the tsc rate against CLOCK_MONOTONIC over usec.
+  // returns false if the tsc is not usable.
+  bool calibrate(uint64_t usec = 10000) {
+    usable = invariant_tsc();
+    if (!usable)
+      return false;
+    uint64_t t0 = 0, n0 = 0, t1 = 0, n1 = 0;
+    sample(&t0, &n0);
+    do {
+      sample(&t1, &n1);
+    } while (n1 - n0 < usec * 1000);
+    Calibration c;
+    c.tsc = t1;
+    c.ns = n1;
+    c.mult = ((n1 - n0) << SHIFT) / (t1 - t0);
+    resync_ticks = (resync_ns << SHIFT) / c.mult;
+    sync_tsc = t1;
+    sync_ns = n1;
+    publish(c);
+    return true;
+  }
+
+  bool is_usable() const {
+    return usable;
+  }
+
+  uint64_t now_ns() {
+    if (!usable)
+      return ceph_clock_gettime_ns(CLOCK_MONOTONIC);
+    Calibration c = read_cal();
+    uint64_t tsc = rdtsc();
+    if (tsc - c.tsc >= resync_ticks) {
+      resync(c);
+      c = read_cal();
+      tsc = rdtsc(); // must not predate the new base
+    }
+    return extrapolate(c, tsc);
+  }
+};
+
+inline TscClock &ceph_tsc_clock() {
+  static TscClock clock;
+  return clock;
+}
+
+inline uint64_t ceph_clock_read_ns(int source) {
+  switch (source) {
+  case CEPH_CLOCK_REALTIME:
+    return ceph_clock_gettime_ns(CLOCK_REALTIME);
+  case CEPH_CLOCK_MONOTONIC_COARSE:
+#ifdef CLOCK_MONOTONIC_COARSE
+    return ceph_clock_gettime_ns(CLOCK_MONOTONIC_COARSE);
+#endif
+  case CEPH_CLOCK_MONOTONIC:
+    return ceph_clock_gettime_ns(CLOCK_MONOTONIC);
+  case CEPH_CLOCK_TSC:
+    return ceph_tsc_clock().now_ns();
+  }
+  return ceph_clock_gettime_ns(CLOCK_MONOTONIC);
+}
+
+inline utime_t ceph_clock_read(int source) {
+  uint64_t ns = ceph_clock_read_ns(source);
+  return utime_t(ns / 1000000000ull, ns % 1000000000ull);
+}
+
+/*
+ * a clock that is read at most once per scheduling pass. callers mark
+ * the start of a pass with begin_pass(); every now() until the next
+ * one returns the same time. with CEPH_CLOCK_MANUAL, now() returns
+ * whatever was last set(), across passes.
+ */
+class CachedClock {
+  int source;
+  utime_t cached;
+  bool valid;
+
+public:
+  explicit CachedClock(int s = CEPH_CLOCK_MONOTONIC)
+    : source(s), valid(false) {}
+
+  void set_source(int s) {
+    source = s;
+    valid = false;
+  }
+  int get_source() const {
+    return source;
+  }
+  void begin_pass() {
+    if (source != CEPH_CLOCK_MANUAL)
+      valid = false;
+  }
+  void set(utime_t t) {
+    cached = t;
+    valid = true;
+  }
+  utime_t now() {
+    if (!valid) {
+      cached = ceph_clock_read(source);
+      valid = true;
+    }
+    return cached;
+  }
+};
+
+#endif
@@ -0,0 +1,486 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2004-2006 Sage Weil <sage@newdream.net>
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef NUMA_DMCLOCK_H
+#define NUMA_DMCLOCK_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <map>
+#include <vector>
+
+#include "PrioritizedQueueDMClock.h"
+
+#ifdef HAVE_LIBNUMA
+#include <new>
+#include <numa.h>
+#endif
+
+/**
+ * cpu to node map, read from sysfs so that libnuma is not required.
+ * simulate() splits the cpus into fake nodes for testing on
+ * single-socket machines.
+ */
+struct NumaTopology {
+	std::vector<int> cpu_node;
+	std::vector<std::vector<int> > node_cpus;
+
+	NumaTopology() {
+		simulate(1);
+	}
+
+	unsigned nodes() const {
+		return node_cpus.size();
+	}
+
+	int node_of_cpu(int cpu) const {
+		if (cpu < 0 || (size_t) cpu >= cpu_node.size())
+			return 0;
+		return cpu_node[cpu];
+	}
+
+	int current_node() const {
+		return node_of_cpu(sched_getcpu());
+	}
+
+	// parse /sys/devices/system/node/node<n>/cpulist. returns the
+	// number of nodes found, or -errno.
+	int load() {
+		std::vector<std::vector<int> > found;
+		for (int n = 0;; n++) {
+			char path[64];
+			snprintf(path, sizeof(path),
+					"/sys/devices/system/node/node%d/cpulist", n);
+			FILE *fp = fopen(path, "r");
+			if (!fp) {
+				if (n == 0)
+					return -errno;
+				break;
+			}
+			std::vector<int> cpus;
+			int lo, hi;
+			char sep;
+			while (fscanf(fp, "%d", &lo) == 1) {
+				hi = lo;
+				sep = fgetc(fp);
+				if (sep == '-') {
+					if (fscanf(fp, "%d", &hi) != 1)
+						break;
+					sep = fgetc(fp);
+				}
+				for (int c = lo; c <= hi; c++)
+					cpus.push_back(c);
+				if (sep != ',')
+					break;
+			}
+			fclose(fp);
+			found.push_back(cpus);
+		}
+		assign(found);
+		return nodes();
+	}
+
+	void simulate(unsigned n) {
+		int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		if (ncpu < 1)
+			ncpu = 1;
+		std::vector<std::vector<int> > found(n);
+		for (int c = 0; c < ncpu; c++)
+			found[(unsigned) c * n / ncpu].push_back(c);
+		assign(found);
+	}
+
+	// restrict the calling thread to node's cpus
+	int bind_thread(unsigned node) const {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (size_t i = 0; i < node_cpus[node].size(); i++)
+			CPU_SET(node_cpus[node][i], &set);
+		if (CPU_COUNT(&set) == 0)
+			return 0;
+		return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+private:
+	void assign(const std::vector<std::vector<int> > &found) {
+		node_cpus = found;
+		cpu_node.clear();
+		for (size_t n = 0; n < found.size(); n++)
+			for (size_t i = 0; i < found[n].size(); i++) {
+				int c = found[n][i];
+				if ((size_t) c >= cpu_node.size())
+					cpu_node.resize(c + 1, 0);
+				cpu_node[c] = n;
+			}
+	}
+};
+
+/**
+ * One dmClock scheduler per NUMA node.
+ *
+ * A client is bound to the node that owns its connection, and all of
+ * its requests are queued and dispatched there, so enqueues from that
+ * node's messenger threads never touch remote scheduler state. Each
+ * shard is constructed by a thread running on its node, which puts
+ * its memory on that node under first-touch (or numa_alloc_onnode
+ * with HAVE_LIBNUMA).
+ *
+ * The device's throughput is divided between the shards. balance()
+ * gives every shard the reservations of its clients plus a cut of the
+ * rest in proportion to its recent demand; it is meant to be called
+ * at a low rate, e.g. once a second.
+ *
+ * A worker whose own shard is empty can steal_mClock() from the
+ * others, so skewed client placement does not strand capacity.
+ *
+ * A client's reservation is counted on its shard from its first
+ * enqueue, follows its SLO, and is dropped along with its placement
+ * once the shard forgets it, e.g. after idle reclaim or purge().
+ *
+ * The client to node map is only consulted when a client is placed,
+ * or queued to from another node: an enqueue first looks the client
+ * up in the caller's own shard, under the shard lock it takes anyway,
+ * and a shard knows exactly the clients placed on it.
+ */
+template<typename T, typename K, typename Policy = DMClockFull>
+class NumaDMClock {
+	typedef PrioritizedQueueDMClock<T, K, Policy> Queue;
+
+	struct Shard: public Queue::ClientListener {
+		NumaDMClock *owner;
+		unsigned node;
+		pthread_mutex_t lock;
+		Queue q;
+		std::vector<int64_t> reserve; // counted in reserved, by q's client id
+		uint64_t reserved; // sum of reservations bound here
+		uint64_t demand; // ops enqueued since the last balance(), under lock
+		volatile unsigned backlog; // dmClock length, read without lock
+		Shard(NumaDMClock *_owner, unsigned _node, unsigned throughput,
+				unsigned min_cost) :
+				owner(_owner), node(_node), q(throughput, min_cost), reserved(0), demand(
+						0), backlog(0) {
+			pthread_mutex_init(&lock, NULL);
+			q.set_mClock_trace(false);
+			q.set_client_listener(this);
+		}
+		~Shard() {
+			pthread_mutex_destroy(&lock);
+		}
+		// count a client's reserve here, where it was just queued, or
+		// move its count to a new reserve. under lock.
+		void place(typename Queue::ClientId id, int64_t r) {
+			if (id.id >= reserve.size())
+				reserve.resize(id.id + 1, 0);
+			if (reserve[id.id] != r) {
+				__sync_fetch_and_add(&reserved, r - reserve[id.id]);
+				reserve[id.id] = r;
+			}
+		}
+		// called by q, so under lock. cl still has its id, which q is
+		// about to recycle.
+		void forget(const K &cl) {
+			typename Queue::ClientId id;
+			if (q.find_client(cl, &id) && id.id < reserve.size()) {
+				__sync_fetch_and_sub(&reserved, reserve[id.id]);
+				reserve[id.id] = 0;
+			}
+			owner->unplace(cl, node);
+		}
+	};
+
+	NumaTopology topo;
+	unsigned throughput;
+	std::vector<Shard*> shards;
+	pthread_rwlock_t placement_lock;
+	std::map<K, unsigned> placement; // client to node
+
+	std::vector<bool> numa_mem; // shard came from numa_alloc_onnode
+
+	struct Builder {
+		NumaDMClock *self;
+		unsigned node, min_cost;
+		Shard *shard;
+		bool numa_mem;
+	};
+
+	static void *build_shard(void *arg) {
+		Builder *b = (Builder *) arg;
+		b->self->topo.bind_thread(b->node);
+		unsigned share = b->self->throughput / b->self->topo.nodes();
+		unsigned throughput = share ? share : 1;
+#ifdef HAVE_LIBNUMA
+		// node local if libnuma can, first touch otherwise
+		void *mem = numa_alloc_onnode(sizeof(Shard), b->node);
+		if (mem)
+			b->shard = new (mem) Shard(b->self, b->node, throughput, b->min_cost);
+		else
+			b->shard = new Shard(b->self, b->node, throughput, b->min_cost);
+		b->numa_mem = mem != NULL;
+#else
+		b->shard = new Shard(b->self, b->node, throughput, b->min_cost);
+#endif
+		return NULL;
+	}
+
+	void destroy_shard(size_t n) {
+		Shard *s = shards[n];
+#ifdef HAVE_LIBNUMA
+		if (numa_mem[n]) {
+			s->~Shard();
+			numa_free(s, sizeof(Shard));
+			return;
+		}
+#endif
+		delete s;
+	}
+
+	// look up cl's node, binding it to the caller's node on first use
+	unsigned node_of(K cl) {
+		pthread_rwlock_rdlock(&placement_lock);
+		typename std::map<K, unsigned>::iterator it = placement.find(cl);
+		if (it != placement.end()) {
+			unsigned node = it->second;
+			pthread_rwlock_unlock(&placement_lock);
+			return node;
+		}
+		pthread_rwlock_unlock(&placement_lock);
+
+		pthread_rwlock_wrlock(&placement_lock);
+		it = placement.insert(
+				std::make_pair(cl, topo.current_node() % shards.size())).first;
+		unsigned node = it->second;
+		pthread_rwlock_unlock(&placement_lock);
+		return node;
+	}
+
+	// cl is about to be queued on node, under its lock: put the
+	// placement back if node forgot cl between node_of() and taking
+	// the lock
+	void replace(K cl, unsigned node) {
+		pthread_rwlock_wrlock(&placement_lock);
+		placement.insert(std::make_pair(cl, node));
+		pthread_rwlock_unlock(&placement_lock);
+	}
+
+	// node's queue forgot cl: drop its placement, unless it has since
+	// been placed elsewhere
+	void unplace(const K &cl, unsigned node) {
+		pthread_rwlock_wrlock(&placement_lock);
+		typename std::map<K, unsigned>::iterator it = placement.find(cl);
+		if (it != placement.end() && it->second == node)
+			placement.erase(it);
+		pthread_rwlock_unlock(&placement_lock);
+	}
+
+	NumaDMClock(const NumaDMClock &);
+	NumaDMClock &operator=(const NumaDMClock &);
+
+public:
+	// topo is copied; pass one from NumaTopology::load() or
+	// simulate(). throughput is the whole device's.
+	NumaDMClock(const NumaTopology &t, unsigned _throughput, unsigned min_cost) :
+			topo(t), throughput(_throughput) {
+		pthread_rwlock_init(&placement_lock, NULL);
+		for (unsigned n = 0; n < topo.nodes(); n++) {
+			Builder b;
+			b.self = this;
+			b.node = n;
+			b.min_cost = min_cost;
+			b.shard = NULL;
+			b.numa_mem = false;
+			pthread_t tid;
+			if (pthread_create(&tid, NULL, build_shard, &b) == 0)
+				pthread_join(tid, NULL);
+			else
+				build_shard(&b);
+			shards.push_back(b.shard);
+			numa_mem.push_back(b.numa_mem);
+		}
+	}
+
+	~NumaDMClock() {
+		for (size_t n = 0; n < shards.size(); n++)
+			destroy_shard(n);
+		pthread_rwlock_destroy(&placement_lock);
+	}
+
+	const NumaTopology &topology() const {
+		return topo;
+	}
+
+	unsigned nodes() const {
+		return shards.size();
+	}
+
+	// pin cl to node; call before its first enqueue, e.g. when its
+	// connection is accepted. returns -EEXIST if cl is already bound
+	// elsewhere.
+	int bind_client(K cl, unsigned node) {
+		assert(node < shards.size());
+		pthread_rwlock_wrlock(&placement_lock);
+		typename std::map<K, unsigned>::iterator it = placement.find(cl);
+		int r = 0;
+		if (it == placement.end())
+			placement[cl] = node;
+		else if (it->second != node)
+			r = -EEXIST;
+		pthread_rwlock_unlock(&placement_lock);
+		return r;
+	}
+
+	int enqueue_mClock(K cl, struct SLO slo, unsigned cost, T item) {
+		typename Queue::ClientId id;
+		bool held = false;
+		Shard *s = shards[topo.current_node() % shards.size()];
+		pthread_mutex_lock(&s->lock);
+		if (!s->q.find_client(cl, &id)) {
+			// not placed here: it lives on another node, or nowhere yet
+			pthread_mutex_unlock(&s->lock);
+			s = shards[node_of(cl)];
+			pthread_mutex_lock(&s->lock);
+			replace(cl, s->node);
+			id = s->q.intern_client(cl);
+			held = true;
+		}
+		int r = s->q.enqueue_mClock(id, slo, cost, item);
+		if (r == 0) {
+			s->demand++;
+			s->place(id, slo.reserve);
+		}
+		// a refused first enqueue leaves cl unplaced again
+		if (held)
+			s->q.release_client(id);
+		s->backlog = s->q.mClock_length();
+		pthread_mutex_unlock(&s->lock);
+		return r;
+	}
+
+	// dequeue from node's shard. returns -EAGAIN if it is empty.
+	int dequeue_mClock(unsigned node, T *out) {
+		Shard *s = shards[node];
+		pthread_mutex_lock(&s->lock);
+		int r = -EAGAIN;
+		if (!s->q.empty()) {
+			*out = s->q.dequeue_mClock();
+			r = 0;
+		}
+		s->backlog = s->q.mClock_length();
+		pthread_mutex_unlock(&s->lock);
+		return r;
+	}
+
+	// take proportional-phase work from another shard for the worker
+	// of node thief. victims are picked from their unlocked backlog
+	// hints and only try-locked, so a thief never waits on, or
+	// delays, a busy shard's own worker; the victim's reservation and
+	// limit tags are left for it to serve. returns -EAGAIN if no
+	// shard had anything to give.
+	int steal_mClock(unsigned thief, T *out) {
+		size_t n = shards.size();
+		for (size_t k = 1; k < n; k++) {
+			Shard *s = shards[(thief + k) % n];
+			if (!s->backlog)
+				continue;
+			if (pthread_mutex_trylock(&s->lock) != 0)
+				continue;
+			int r = s->q.steal_mClock(out);
+			s->backlog = s->q.mClock_length();
+			pthread_mutex_unlock(&s->lock);
+			if (r == 0)
+				return 0;
+		}
+		return -EAGAIN;
+	}
+
+	// idle clients are forgotten, and their reservations dropped,
+	// ttl after their last request; see set_mClock_idle_ttl()
+	void set_idle_ttl(int64_t ttl, unsigned batch = 8) {
+		for (size_t n = 0; n < shards.size(); n++) {
+			pthread_mutex_lock(&shards[n]->lock);
+			shards[n]->q.set_mClock_idle_ttl(ttl, batch);
+			pthread_mutex_unlock(&shards[n]->lock);
+		}
+	}
+
+	// forget every idle client now
+	void purge() {
+		for (size_t n = 0; n < shards.size(); n++) {
+			pthread_mutex_lock(&shards[n]->lock);
+			shards[n]->q.purge_mClock();
+			pthread_mutex_unlock(&shards[n]->lock);
+		}
+	}
+
+	// sum of the reservations counted on node, for balance()
+	uint64_t reserved(unsigned node) const {
+		return __sync_fetch_and_add(&shards[node]->reserved, 0);
+	}
+
+	unsigned length(unsigned node) {
+		Shard *s = shards[node];
+		pthread_mutex_lock(&s->lock);
+		unsigned len = s->q.length();
+		pthread_mutex_unlock(&s->lock);
+		return len;
+	}
+
+	unsigned get_throughput(unsigned node) {
+		Shard *s = shards[node];
+		pthread_mutex_lock(&s->lock);
+		unsigned t = s->q.get_mClock_throughput();
+		pthread_mutex_unlock(&s->lock);
+		return t;
+	}
+
+	// redistribute the device's throughput. each shard keeps what its
+	// clients have reserved; the remainder follows demand. if the
+	// reservations alone exceed the device they are scaled down.
+	void balance() {
+		size_t n = shards.size();
+		std::vector<uint64_t> reserved(n), demand(n);
+		uint64_t total_reserved = 0, total_demand = 0;
+		for (size_t i = 0; i < n; i++) {
+			reserved[i] = __sync_fetch_and_add(&shards[i]->reserved, 0);
+			pthread_mutex_lock(&shards[i]->lock);
+			demand[i] = shards[i]->demand;
+			shards[i]->demand = 0;
+			pthread_mutex_unlock(&shards[i]->lock);
+			total_reserved += reserved[i];
+			total_demand += demand[i];
+		}
+		uint64_t spare =
+				total_reserved < throughput ? throughput - total_reserved : 0;
+		for (size_t i = 0; i < n; i++) {
+			uint64_t share;
+			if (total_reserved > throughput)
+				share = reserved[i] * throughput / total_reserved;
+			else
+				share = reserved[i];
+			if (total_demand)
+				share += spare * demand[i] / total_demand;
+			else
+				share += spare / n;
+			if (share == 0)
+				share = 1;
+			pthread_mutex_lock(&shards[i]->lock);
+			shards[i]->q.set_mClock_throughput(share);
+			pthread_mutex_unlock(&shards[i]->lock);
+		}
+	}
+};
+
+#endif
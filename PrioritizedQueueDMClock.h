@@ -19,12 +19,23 @@
 //#include "common/Formatter.h"
 
 #include <map>
+#include <vector>
 #include <utility>
 #include <list>
 #include <algorithm>
 #include <time.h>
 #include <float.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if __cplusplus >= 201103L
+#include <type_traits>
+#endif
 #include "utime.h"
+#include "Clock.h"
 
 #include "/usr/include/assert.h"
 
@@ -62,49 +73,854 @@ struct SLO {
 	int64_t limit;
 };
 
-template<typename T, typename K>
+// which dmClock tags a scheduler keeps. a narrower policy drops the
+// other tags from every client and compiles their branches out; its
+// clients must leave the matching SLO fields at 0.
+struct DMClockFull {
+	enum {
+		RESERVE = 1, PROP = 1, LIMIT = 1
+	};
+};
+
+struct DMClockReserveLimit {
+	enum {
+		RESERVE = 1, PROP = 0, LIMIT = 1
+	};
+};
+
+struct DMClockPropOnly {
+	enum {
+		RESERVE = 0, PROP = 1, LIMIT = 0
+	};
+};
+
+template<typename T, typename K, typename Policy = DMClockFull>
 class PrioritizedQueueDMClock {
+	friend struct DMClockTestAccess; // PriorityQueueTest
 	int64_t total_priority;
 	int64_t max_tokens_per_subqueue;
 	int64_t min_cost;
+	double_t token_rate; // tokens/sec shared by all classes; 0 = per op
+	CachedClock clock; // read at most once per enqueue or dequeue
 
-	typedef std::list<std::pair<double, T> > ListPairs; //will hold deadline time-stamp
-	template<class F>
-	static unsigned filter_list_pairs(ListPairs *l, F f, std::list<T> *out) {
-		unsigned ret = 0;
-		if (out) {
-			for (typename ListPairs::reverse_iterator i = l->rbegin();
-					i != l->rend(); ++i) {
-				if (f(i->second)) {
-					out->push_front(i->second);
+public:
+	// caps on queued items and bytes (item cost); 0 means unlimited.
+	// a client refused by admit() is throttled until both it and, if
+	// it was the total that was full, the whole queue drain to
+	// low_water percent of their caps.
+	struct AdmissionLimits {
+		unsigned client_items, total_items;
+		uint64_t client_bytes, total_bytes;
+		unsigned low_water;
+		AdmissionLimits() :
+				client_items(0), total_items(0), client_bytes(0), total_bytes(
+						0), low_water(50) {
+		}
+	};
+
+	// lets the messenger stop and resume reading from a client
+	class AdmissionListener {
+	public:
+		virtual ~AdmissionListener() {
+		}
+		virtual void throttle(const K &cl) = 0;
+		virtual void unthrottle(const K &cl) = 0;
+	};
+
+	// coalesces a client's queued dmClock requests at dequeue, e.g.
+	// sequential writes into one larger write
+	class MergeHook {
+	public:
+		virtual ~MergeHook() {
+		}
+		// may next, queued right behind merged, be folded into it?
+		virtual bool can_merge(const T &merged, const T &next) = 0;
+		virtual void merge(T &merged, const T &next) = 0;
+	};
+
+	// told when a key is forgotten and its id freed, e.g. after idle
+	// reclaim or purge_mClock() drop its last tags
+	class ClientListener {
+	public:
+		virtual ~ClientListener() {
+		}
+		virtual void forget(const K &cl) = 0;
+	};
+
+	// a client's dense id, from intern_client(). enqueueing by id
+	// skips looking the key up. an id stays valid until it is handed
+	// back with release_client(). once nothing else holds it either,
+	// it is recycled for the next new key, so a stale ClientId names
+	// whichever client has the id now, or none; using one is a bug
+	// the queue cannot detect.
+	struct ClientId {
+		uint32_t id;
+		ClientId() :
+				id(UINT32_MAX) {
+		}
+		explicit ClientId(uint32_t i) :
+				id(i) {
+		}
+	};
+
+private:
+	// every live key, mapped to a dense id. the queues keep ids
+	// rather than keys; a key is looked at again only to call the
+	// admission listener and to write checkpoints.
+	//
+	// an id is held by each intern_client() not yet released, by each
+	// device the client has a dmClock tag on, idle or not, while it
+	// has items queued and while it is throttled. once the last hold
+	// goes, e.g. when idle reclaim drops its tags, the key is
+	// forgotten and the id reused, so the tables indexed by id stay
+	// as large as the most clients ever live at once.
+	//
+	// keys restored in bulk into an empty table go to sorted, a flat
+	// array built in one pass for a fraction of what a map node costs
+	// each; everything interned later goes to ids. a key lives in one
+	// of them, never both. a forgotten key stays in sorted, with
+	// NO_ID, until it is interned again.
+	struct ClientTable {
+		typedef std::map<K, uint32_t> Ids;
+		typedef std::vector<std::pair<K, uint32_t> > Sorted;
+		static const uint32_t NO_ID = UINT32_MAX;
+		Ids ids;
+		Sorted sorted;
+		std::vector<K> keys;
+		std::vector<uint32_t> refs;
+		std::vector<uint32_t> free_ids;
+		ClientListener *listener;
+
+		ClientTable() :
+				listener(NULL) {
+		}
+
+		static bool key_less(const std::pair<K, uint32_t> &e, const K &cl) {
+			return e.first < cl;
+		}
+		typename Sorted::iterator find_sorted(const K &cl) {
+			typename Sorted::iterator i = std::lower_bound(sorted.begin(),
+					sorted.end(), cl, key_less);
+			return i != sorted.end() && !(cl < i->first) ? i : sorted.end();
+		}
+		typename Sorted::const_iterator find_sorted(const K &cl) const {
+			return const_cast<ClientTable *>(this)->find_sorted(cl);
+		}
+		bool empty() const {
+			return ids.empty() && sorted.empty();
+		}
+		uint32_t next_id() const {
+			return free_ids.empty() ? keys.size() : free_ids.back();
+		}
+		// give cl the id next_id() returned, now that it is filed
+		void bind(uint32_t id, const K &cl) {
+			if (id == keys.size()) {
+				keys.push_back(cl);
+				refs.push_back(0);
+			} else {
+				free_ids.pop_back();
+				keys[id] = cl;
+			}
+		}
+		// a new key starts with no holds: the caller must take one
+		// before anything can release it
+		uint32_t intern(const K &cl) {
+			if (!sorted.empty()) {
+				typename Sorted::iterator i = find_sorted(cl);
+				if (i != sorted.end()) {
+					if (i->second == NO_ID) {
+						i->second = next_id();
+						bind(i->second, cl);
+					}
+					return i->second;
 				}
 			}
+			std::pair<typename Ids::iterator, bool> r = ids.insert(
+					std::make_pair(cl, next_id()));
+			if (r.second)
+				bind(r.first->second, cl);
+			return r.first->second;
 		}
-		for (typename ListPairs::iterator i = l->begin(); i != l->end();) {
-			if (f(i->second)) {
-				l->erase(i++);
-				++ret;
+		// bulk intern into an empty table, keys in strictly increasing
+		// order: each is appended to sorted, with no lookup
+		uint32_t intern_sorted(const K &cl) {
+			assert(ids.empty());
+			assert(sorted.empty() || sorted.back().first < cl);
+			uint32_t id = next_id();
+			sorted.push_back(std::make_pair(cl, id));
+			bind(id, cl);
+			return id;
+		}
+		void reserve(size_t n) {
+			keys.reserve(keys.size() + n);
+			refs.reserve(refs.size() + n);
+		}
+		void ref(uint32_t id) {
+			refs[id]++;
+		}
+		void unref(uint32_t id) {
+			assert(refs[id]);
+			if (--refs[id])
+				return;
+			if (listener)
+				listener->forget(keys[id]);
+			typename Sorted::iterator i = find_sorted(keys[id]);
+			if (i != sorted.end())
+				i->second = NO_ID;
+			else
+				ids.erase(keys[id]);
+			keys[id] = K();
+			for (size_t d = 0; d < slos.size(); d++)
+				if (id < slos[d].size())
+					slos[d][id] = SLO();
+			free_ids.push_back(id);
+		}
+		bool find(const K &cl, uint32_t *id) const {
+			typename Sorted::const_iterator s = find_sorted(cl);
+			if (s != sorted.end()) {
+				*id = s->second;
+				return s->second != NO_ID;
+			}
+			typename Ids::const_iterator i = ids.find(cl);
+			if (i == ids.end())
+				return false;
+			*id = i->second;
+			return true;
+		}
+
+		// every live key and its id, in key order
+		class Cursor {
+			typename Sorted::const_iterator s, s_end;
+			typename Ids::const_iterator m, m_end;
+			void skip() {
+				while (s != s_end && s->second == NO_ID)
+					++s;
+			}
+			bool in_sorted() const {
+				return m == m_end || (s != s_end && s->first < m->first);
+			}
+		public:
+			explicit Cursor(const ClientTable &t) :
+					s(t.sorted.begin()), s_end(t.sorted.end()), m(t.ids.begin()), m_end(
+							t.ids.end()) {
+				skip();
+			}
+			bool done() const {
+				return s == s_end && m == m_end;
+			}
+			const K &key() const {
+				return in_sorted() ? s->first : m->first;
+			}
+			uint32_t id() const {
+				return in_sorted() ? s->second : m->second;
+			}
+			void next() {
+				if (in_sorted()) {
+					++s;
+					skip();
+				} else {
+					++m;
+				}
+			}
+		};
+
+		const K &key(uint32_t id) const {
+			return keys[id];
+		}
+
+		// SLOs for enqueues that name a device, by device and then id.
+		// an all-zero SLO is one that was never set.
+		std::vector<std::vector<SLO> > slos;
+
+		void set_slo(uint32_t id, unsigned device, const SLO &slo) {
+			if (device >= slos.size())
+				slos.resize(device + 1);
+			if (id >= slos[device].size())
+				slos[device].resize(id + 1, SLO());
+			slos[device][id] = slo;
+		}
+		const SLO *slo(uint32_t id, unsigned device) const {
+			if (device >= slos.size() || id >= slos[device].size())
+				return NULL;
+			const SLO &s = slos[device][id];
+			if (!s.reserve && !s.prop && !s.limit)
+				return NULL;
+			return &s;
+		}
+	};
+	ClientTable clients;
+
+	struct ClientDepth {
+		unsigned items;
+		uint64_t bytes;
+		bool throttled;
+		ClientDepth() :
+				items(0), bytes(0), throttled(false) {
+		}
+	};
+
+	// queued items across every sub-queue, in total and per client.
+	// each sub-queue reports its changes here, so length() and empty()
+	// never have to walk the queues.
+	typedef std::vector<ClientDepth> ClientDepths;
+	struct Depth {
+		int64_t total;
+		uint64_t bytes;
+		ClientDepths clients; // by client id
+		AdmissionLimits limits;
+		AdmissionListener *listener;
+		ClientTable *table;
+		std::vector<uint32_t> waiters; // throttled because the total was full
+
+		Depth() :
+				total(0), bytes(0), listener(NULL), table(NULL) {
+		}
+		ClientDepth &get(uint32_t id) {
+			if (id >= clients.size())
+				clients.resize(id + 1);
+			return clients[id];
+		}
+		bool drained(uint64_t v, uint64_t cap) const {
+			return !cap || v * 100 <= cap * limits.low_water;
+		}
+		bool client_drained(const ClientDepth &c) const {
+			return drained(c.items, limits.client_items)
+					&& drained(c.bytes, limits.client_bytes);
+		}
+		bool total_drained() const {
+			return drained(total, limits.total_items)
+					&& drained(bytes, limits.total_bytes);
+		}
+		void throttle(uint32_t id, ClientDepth &c) {
+			c.throttled = true;
+			table->ref(id);
+			if (listener)
+				listener->throttle(table->key(id));
+		}
+		void unthrottle(uint32_t id, ClientDepth &c) {
+			c.throttled = false;
+			if (listener)
+				listener->unthrottle(table->key(id));
+			table->unref(id);
+		}
+		// 0 to accept, -ENOSPC when the queue as a whole is full, or
+		// -EAGAIN when only cl is over its share. a client with nothing
+		// queued always gets one item in, however large.
+		int admit(uint32_t id, uint64_t cost) {
+			if (total
+					&& ((limits.total_items && total >= limits.total_items)
+							|| (limits.total_bytes
+									&& bytes + cost > limits.total_bytes))) {
+				ClientDepth &c = get(id);
+				if (!c.throttled) {
+					waiters.push_back(id);
+					throttle(id, c);
+				}
+				return -ENOSPC;
+			}
+			if (!limits.client_items && !limits.client_bytes)
+				return 0;
+			if (id >= clients.size() || !clients[id].items)
+				return 0;
+			ClientDepth &c = clients[id];
+			if ((limits.client_items && c.items >= limits.client_items)
+					|| (limits.client_bytes
+							&& c.bytes + cost > limits.client_bytes)) {
+				if (!c.throttled)
+					throttle(id, c);
+				return -EAGAIN;
+			}
+			return 0;
+		}
+		void add(uint32_t id, unsigned n, uint64_t cost) {
+			total += n;
+			bytes += cost;
+			ClientDepth &c = get(id);
+			if (!c.items)
+				table->ref(id);
+			c.items += n;
+			c.bytes += cost;
+		}
+		void sub(uint32_t id, unsigned n, uint64_t cost) {
+			if (!n)
+				return;
+			total -= n;
+			bytes -= cost;
+			assert(id < clients.size() && clients[id].items >= n);
+			ClientDepth &c = clients[id];
+			c.items -= n;
+			c.bytes -= cost;
+			if (c.throttled && client_drained(c) && total_drained())
+				unthrottle(id, c);
+			if (!waiters.empty() && total_drained())
+				release_waiters();
+			if (!c.items)
+				table->unref(id);
+		}
+		void release_waiters() {
+			std::vector<uint32_t> w;
+			w.swap(waiters);
+			for (std::vector<uint32_t>::iterator k = w.begin(); k != w.end();
+					++k)
+				if (clients[*k].throttled)
+					unthrottle(*k, clients[*k]);
+		}
+		unsigned client(uint32_t id) const {
+			return id < clients.size() ? clients[id].items : 0;
+		}
+	};
+	Depth depth;
+
+	// requests a device has been handed and not yet completed. the
+	// dmClock dequeues stop while in_flight has reached limit, so the
+	// backlog waits in the scheduler, where its order can still
+	// change, rather than in the device queue. with a latency target
+	// the limit adapts: after each limit's worth of completions it
+	// grows by one if they all finished within target and shrinks by
+	// a quarter if any did not.
+	struct DispatchWindow {
+		unsigned in_flight;
+		unsigned limit; // 0 = no limit
+		unsigned min_limit, max_limit;
+		uint64_t target; // latency, in the caller's units; 0 = fixed
+		unsigned acked; // completions in the current round
+		bool late; // one of them was over target
+
+		DispatchWindow() :
+				in_flight(0), limit(0), min_limit(1), max_limit(0), target(0), acked(
+						0), late(false) {
+		}
+		bool full() const {
+			return limit && in_flight >= limit;
+		}
+		void completed(uint64_t latency) {
+			assert(in_flight);
+			in_flight--;
+			if (!target)
+				return;
+			if (latency > target)
+				late = true;
+			if (++acked < limit)
+				return;
+			if (late)
+				limit = limit * 3 / 4;
+			else
+				limit++;
+			if (limit < min_limit)
+				limit = min_limit;
+			if (limit > max_limit)
+				limit = max_limit;
+			acked = 0;
+			late = false;
+		}
+	};
+
+public:
+	// names one queued item, for cancel(). a handle goes stale once its
+	// item is dequeued or removed; using it then is harmless.
+	struct Handle {
+		uint32_t index;
+		uint32_t gen;
+		Handle() :
+				index(UINT32_MAX), gen(0) {
+		}
+	};
+
+	// what one dmClock dequeue charged its client's tags, for
+	// requeue_mClock() to refund if that op has to be retried. it is
+	// spent by the refund.
+	struct Charge {
+		uint32_t id; // client id
+		int8_t tag; // the tag type charged, -1 once spent
+		uint32_t n; // requests merged into the op
+		Charge() :
+				id(0), tag(-1), n(0) {
+		}
+	};
+
+private:
+	enum item_queue_t {
+		IN_NONE = 0, IN_DMCLOCK, IN_QUEUE, IN_HIGH_QUEUE
+	};
+
+	// queued items live in a pool and are chained into FIFOs by index,
+	// so an item can be unlinked in O(1) given its Handle. gen is
+	// bumped every time an entry is reused, which is how stale handles
+	// are told apart.
+	static const uint32_t INIL = UINT32_MAX;
+
+	struct Item {
+		T item;
+		unsigned cost;
+		uint32_t gen;
+		uint32_t prev, next;
+		uint32_t owner; // client slot (dmClock)
+		uint32_t cid; // client id (SubQueue)
+		uint8_t where; // item_queue_t
+		// strict/weighted priority, or for dmClock items the index of
+		// the device queue, which caps add_mClock_device() at 256
+		uint8_t priority;
+		Item() :
+				cost(0), gen(0), prev(INIL), next(INIL), owner(0), cid(0), where(
+						IN_NONE), priority(0) {
+		}
+	};
+
+	struct ItemList {
+		uint32_t head, tail;
+		unsigned count;
+		ItemList() :
+				head(INIL), tail(INIL), count(0) {
+		}
+		bool empty() const {
+			return count == 0;
+		}
+	};
+
+	struct ItemPool {
+		std::vector<Item> items;
+		std::vector<uint32_t> free;
+
+		Item &operator[](uint32_t i) {
+			return items[i];
+		}
+		const Item &operator[](uint32_t i) const {
+			return items[i];
+		}
+		uint32_t alloc(const T &item, unsigned cost, uint8_t where,
+				uint32_t owner) {
+			uint32_t i;
+			if (free.empty()) {
+				i = items.size();
+				items.push_back(Item());
 			} else {
-				++i;
+				i = free.back();
+				free.pop_back();
 			}
+			Item &it = items[i];
+			it.item = item;
+			it.cost = cost;
+			it.where = where;
+			it.owner = owner;
+			return i;
+		}
+		void release(uint32_t i) {
+			Item &it = items[i];
+			it.item = T();
+			it.where = IN_NONE;
+			it.gen++;
+			free.push_back(i);
+		}
+		Handle handle(uint32_t i) const {
+			Handle h;
+			h.index = i;
+			h.gen = items[i].gen;
+			return h;
+		}
+		bool valid(const Handle &h) const {
+			return h.index < items.size() && items[h.index].gen == h.gen
+					&& items[h.index].where != IN_NONE;
+		}
+		void push_back(ItemList &l, uint32_t i) {
+			Item &it = items[i];
+			it.prev = l.tail;
+			it.next = INIL;
+			if (l.tail != INIL)
+				items[l.tail].next = i;
+			else
+				l.head = i;
+			l.tail = i;
+			l.count++;
+		}
+		void push_front(ItemList &l, uint32_t i) {
+			Item &it = items[i];
+			it.prev = INIL;
+			it.next = l.head;
+			if (l.head != INIL)
+				items[l.head].prev = i;
+			else
+				l.tail = i;
+			l.head = i;
+			l.count++;
+		}
+		void erase(ItemList &l, uint32_t i) {
+			Item &it = items[i];
+			if (it.prev != INIL)
+				items[it.prev].next = it.next;
+			else
+				l.head = it.next;
+			if (it.next != INIL)
+				items[it.next].prev = it.prev;
+			else
+				l.tail = it.prev;
+			it.prev = it.next = INIL;
+			l.count--;
+		}
+		// single pass over l: matching items are unlinked, released
+		// and put at the front of out (if given), in queue order.
+		template<class F>
+		unsigned filter(ItemList &l, F f, std::list<T> *out, uint64_t *cost) {
+			std::list<T> removed;
+			unsigned ret = 0;
+			uint32_t next;
+			for (uint32_t i = l.head; i != INIL; i = next) {
+				next = items[i].next;
+				if (!f(items[i].item))
+					continue;
+				if (out)
+					removed.push_back(items[i].item);
+				*cost += items[i].cost;
+				erase(l, i);
+				release(i);
+				++ret;
+			}
+			if (out)
+				out->splice(out->begin(), removed);
+			return ret;
+		}
+		// release every item on l, putting them at the front of out
+		unsigned clear(ItemList &l, std::list<T> *out, uint64_t *cost) {
+			std::list<T> removed;
+			unsigned ret = 0;
+			uint32_t next;
+			for (uint32_t i = l.head; i != INIL; i = next) {
+				next = items[i].next;
+				if (out)
+					removed.push_back(items[i].item);
+				*cost += items[i].cost;
+				release(i);
+				++ret;
+			}
+			l = ItemList();
+			if (out)
+				out->splice(out->begin(), removed);
+			return ret;
+		}
+	};
+	ItemPool pool;
+
+	// bounded multi-producer, single-consumer staging ring for
+	// enqueue_mClock. a producer claims room with one fetch-and-add on
+	// count and a slot with one on tail, then publishes the slot by
+	// writing its sequence number: no loops, so staging is wait-free.
+	// the consumer folds published slots in ticket order. because it
+	// only releases room after a slot is read, a claimed slot is
+	// always free by the time its producer gets to it.
+	struct IntakeRing {
+		struct Slot {
+			volatile uint64_t seq; // ticket + 1 once published
+			K cl;
+			unsigned device;
+			SLO slo;
+			unsigned cost;
+			T item;
+			Slot() :
+					seq(0), cl(), device(0), cost(0), item() {
+			}
+		};
+		std::vector<Slot> slots;
+		uint64_t mask;
+		volatile uint64_t count; // claimed and not yet folded
+		volatile uint64_t tail; // next ticket
+		uint64_t head; // next ticket to fold; consumer only
+		volatile uint64_t overflows;
+
+		IntakeRing() :
+				mask(0), count(0), tail(0), head(0), overflows(0) {
 		}
-		return ret;
-	}
+
+		// capacity is rounded up to a power of two. not safe while
+		// anyone is staging or folding.
+		void resize(unsigned capacity) {
+			assert(count == 0);
+			uint64_t n = 1;
+			while (n < capacity)
+				n <<= 1;
+			slots.assign(capacity ? n : 0, Slot());
+			mask = n - 1;
+			tail = head = 0;
+		}
+
+		bool enabled() const {
+			return !slots.empty();
+		}
+
+		// the overflow policy is to refuse: -EAGAIN when the ring is
+		// full, with nothing staged.
+		int push(K cl, unsigned device, const SLO &slo, unsigned cost,
+				const T &item) {
+			if (__sync_fetch_and_add(&count, 1) > mask) {
+				__sync_fetch_and_sub(&count, 1);
+				__sync_fetch_and_add(&overflows, 1);
+				return -EAGAIN;
+			}
+			uint64_t t = __sync_fetch_and_add(&tail, 1);
+			Slot &s = slots[t & mask];
+			s.cl = cl;
+			s.device = device;
+			s.slo = slo;
+			s.cost = cost;
+			s.item = item;
+			__atomic_store_n(&s.seq, t + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+
+		// is the next slot in ticket order published?
+		bool ready() const {
+			return enabled()
+					&& __atomic_load_n(&slots[head & mask].seq, __ATOMIC_ACQUIRE)
+							== head + 1;
+		}
+
+		// consumer: pop the next published slot. stops at the first
+		// slot whose producer is still writing it.
+		bool pop(K *cl, unsigned *device, SLO *slo, unsigned *cost, T *item) {
+			if (!ready())
+				return false;
+			Slot &s = slots[head & mask];
+			*cl = s.cl;
+			*device = s.device;
+			*slo = s.slo;
+			*cost = s.cost;
+			*item = s.item;
+			s.item = T();
+			head++;
+			__sync_fetch_and_sub(&count, 1);
+			return true;
+		}
+	};
+	IntakeRing intake;
 
 	struct SubQueue {
 	private:
-		typedef std::map<K, ListPairs> Classes;
+		// a class's FIFO, linked into a ring with the other classes in
+		// client id order. round robin walks the ring, so moving to the
+		// next class is one pointer rather than a tree step.
+		struct Class {
+			uint32_t id;
+			ItemList items;
+			Class *prev, *next;
+			int64_t deficit; // cost left in this turn (drr)
+			Class() :
+					id(0), prev(NULL), next(NULL), deficit(0) {
+			}
+		};
+		typedef std::map<uint32_t, Class> Classes;
 		Classes q;
 		unsigned tokens, max_tokens;
 		int64_t size;
-		typename Classes::iterator cur;
+		Class *cur;
+		bool drr;
+		utime_t last_refill;
+		double_t token_credit; // fraction of a token not yet credited
+		Depth *depth;
+		ItemPool *pool;
+		uint8_t where, priority; // stamped on our items for cancel()
+
+		Class &get_class(uint32_t id) {
+			std::pair<typename Classes::iterator, bool> r = q.insert(
+					std::make_pair(id, Class()));
+			Class &c = r.first->second;
+			if (!r.second)
+				return c;
+			c.id = id;
+			typename Classes::iterator n = r.first;
+			if (++n == q.end())
+				n = q.begin();
+			if (n == r.first) {
+				c.prev = c.next = &c;
+				start_turn(&c);
+			} else {
+				// just before the class that follows it in id order
+				Class *succ = &n->second;
+				c.next = succ;
+				c.prev = succ->prev;
+				succ->prev->next = &c;
+				succ->prev = &c;
+			}
+			return c;
+		}
+		void erase_class(Class &c) {
+			if (cur == &c)
+				start_turn(c.next == &c ? NULL : c.next);
+			c.prev->next = c.next;
+			c.next->prev = c.prev;
+			q.erase(c.id);
+		}
+		void relink() {
+			Class *prev = NULL;
+			for (typename Classes::iterator i = q.begin(); i != q.end(); ++i) {
+				Class *c = &i->second;
+				if (prev) {
+					prev->next = c;
+					c->prev = prev;
+				}
+				prev = c;
+			}
+			cur = q.empty() ? NULL : &q.begin()->second;
+			if (cur) {
+				cur->prev = prev;
+				prev->next = cur;
+			}
+		}
+
+		// deficit round robin: a class's turn gives it a quantum of
+		// max_tokens worth of cost, which is at least the cost of any
+		// one item, and lasts until its next item costs more than what
+		// is left. what is left carries over to its next turn, so each
+		// class gets the same cost per round however it is split into
+		// items.
+		static int64_t charge(const Item &it) {
+			return it.cost ? it.cost : 1;
+		}
+		void start_turn(Class *c) {
+			cur = c;
+			if (drr && cur)
+				cur->deficit += max_tokens ? max_tokens : 1;
+		}
+		// pass the turn on until cur can afford its next item
+		void settle() {
+			if (!drr)
+				return;
+			while (cur && charge((*pool)[cur->items.head]) > cur->deficit)
+				start_turn(cur->next);
+		}
+
+		Handle push(uint32_t id, unsigned cost, T item, bool front) {
+			uint32_t i = pool->alloc(item, cost, where, 0);
+			(*pool)[i].cid = id;
+			(*pool)[i].priority = priority;
+			Class &c = get_class(id);
+			if (front)
+				pool->push_front(c.items, i);
+			else
+				pool->push_back(c.items, i);
+			size++;
+			depth->add(id, 1, cost);
+			settle();
+			return pool->handle(i);
+		}
 	public:
 		SubQueue(const SubQueue &other) :
 				q(other.q), tokens(other.tokens), max_tokens(other.max_tokens), size(
-						other.size), cur(q.begin()) {
+						other.size), cur(NULL), drr(other.drr), last_refill(
+						other.last_refill), token_credit(other.token_credit), depth(
+						other.depth), pool(other.pool), where(other.where), priority(
+						other.priority) {
+			relink();
+			settle();
 		}
 		SubQueue() :
-				tokens(0), max_tokens(0), size(0), cur(q.begin()) {
+				tokens(0), max_tokens(0), size(0), cur(NULL), drr(false), token_credit(
+						0), depth(NULL), pool(NULL), where(IN_NONE), priority(0) {
+		}
+		void set_depth(Depth *d) {
+			depth = d;
+		}
+		void set_pool(ItemPool *p, uint8_t w, unsigned prio) {
+			pool = p;
+			where = w;
+			priority = prio;
 		}
 		void set_max_tokens(unsigned mt) {
 			max_tokens = mt;
@@ -112,6 +928,15 @@ class PrioritizedQueueDMClock {
 		unsigned get_max_tokens() const {
 			return max_tokens;
 		}
+		// switch between one item per class per turn and deficit round
+		// robin. either way the current class keeps the turn.
+		void set_drr(bool on) {
+			drr = on;
+			for (typename Classes::iterator i = q.begin(); i != q.end(); ++i)
+				i->second.deficit = 0;
+			start_turn(cur);
+			settle();
+		}
 		unsigned num_tokens() const {
 			return tokens;
 		}
@@ -126,33 +951,55 @@ class PrioritizedQueueDMClock {
 			else
 				tokens = 0;
 		}
-		void enqueue(K cl, unsigned cost, T item) {
-			q[cl].push_back(std::make_pair(cost, item));
-			if (cur == q.end())
-				cur = q.begin();
-			size++;
+		// credit rate tokens/sec for the time since the last refill.
+		// anything beyond max_tokens is dropped, as with put_tokens().
+		void clear_tokens() {
+			tokens = 0;
+			token_credit = 0;
+			last_refill = utime_t();
 		}
-		void enqueue_front(K cl, unsigned cost, T item) {
-			q[cl].push_front(std::make_pair(cost, item));
-			if (cur == q.end())
-				cur = q.begin();
-			size++;
+		void refill(utime_t now, double_t rate) {
+			if (now > last_refill && !last_refill.is_zero()) {
+				token_credit += (double_t) (now - last_refill) * rate;
+				if (token_credit >= 1) {
+					unsigned t =
+							token_credit >= max_tokens ?
+									max_tokens : (unsigned) token_credit;
+					put_tokens(t);
+					token_credit -= t;
+				}
+				if (tokens == max_tokens)
+					token_credit = 0;
+			}
+			last_refill = now;
+		}
+		Handle enqueue(uint32_t id, unsigned cost, T item) {
+			return push(id, cost, item, false);
+		}
+		Handle enqueue_front(uint32_t id, unsigned cost, T item) {
+			return push(id, cost, item, true);
 		}
 		std::pair<unsigned, T> front() const {
 			assert(!(q.empty()));
-			assert(cur != q.end());
-			return cur->second.front();
+			assert(cur);
+			const Item &it = (*pool)[cur->items.head];
+			return std::make_pair(it.cost, it.item);
 		}
 		void pop_front() {
 			assert(!(q.empty()));
-			assert(cur != q.end());
-			cur->second.pop_front();
-			if (cur->second.empty())
-				q.erase(cur++);
-			else
-				++cur;
-			if (cur == q.end())
-				cur = q.begin();
+			assert(cur);
+			Class &c = *cur;
+			uint32_t i = c.items.head;
+			depth->sub(c.id, 1, (*pool)[i].cost);
+			if (drr)
+				c.deficit -= charge((*pool)[i]);
+			pool->erase(c.items, i);
+			pool->release(i);
+			if (c.items.empty())
+				erase_class(c);
+			else if (!drr)
+				cur = c.next;
+			settle();
 			size--;
 		}
 		unsigned length() const {
@@ -165,34 +1012,41 @@ class PrioritizedQueueDMClock {
 		template<class F>
 		void remove_by_filter(F f, std::list<T> *out) {
 			for (typename Classes::iterator i = q.begin(); i != q.end();) {
-				size -= filter_list_pairs(&(i->second), f, out);
-				if (i->second.empty()) {
-					if (cur == i)
-						++cur;
-					q.erase(i++);
-				} else {
-					++i;
-				}
+				Class &c = i->second;
+				++i;
+				uint64_t cost = 0;
+				unsigned n = pool->filter(c.items, f, out, &cost);
+				size -= n;
+				depth->sub(c.id, n, cost);
+				if (c.items.empty())
+					erase_class(c);
 			}
-			if (cur == q.end())
-				cur = q.begin();
+			settle();
 		}
-		void remove_by_class(K k, std::list<T> *out) {
-			typename Classes::iterator i = q.find(k);
+		void remove_by_class(uint32_t id, std::list<T> *out) {
+			typename Classes::iterator i = q.find(id);
 			if (i == q.end())
 				return;
-			size -= i->second.size();
-			if (i == cur)
-				++cur;
-			if (out) {
-				for (typename ListPairs::reverse_iterator j =
-						i->second.rbegin(); j != i->second.rend(); ++j) {
-					out->push_front(j->second);
-				}
-			}
-			q.erase(i);
-			if (cur == q.end())
-				cur = q.begin();
+			uint64_t cost = 0;
+			unsigned n = pool->clear(i->second.items, out, &cost);
+			size -= n;
+			depth->sub(id, n, cost);
+			erase_class(i->second);
+			settle();
+		}
+		void cancel(uint32_t i, T *out) {
+			Item &item = (*pool)[i];
+			typename Classes::iterator c = q.find(item.cid);
+			assert(c != q.end());
+			if (out)
+				*out = item.item;
+			size--;
+			depth->sub(item.cid, 1, item.cost);
+			pool->erase(c->second.items, i);
+			pool->release(i);
+			if (c->second.items.empty())
+				erase_class(c->second);
+			settle();
 		}
 
 		/*
@@ -207,261 +1061,1008 @@ class PrioritizedQueueDMClock {
 	};
 
 	struct SubQueueDMClock {
+		friend struct DMClockTestAccess;
 	private:
-		typedef std::map<K, std::list<T> > Requests;
+		// by client id. a backlogged client has a slot in schedule
+		// (cl_index) and an idle one a record in cold; one that has
+		// neither is not registered here.
+		struct ClientQueue {
+			size_t cl_index;
+			size_t cold;
+			ItemList fifo;
+			ClientQueue() :
+					cl_index(NIL), cold(NIL) {
+			}
+		};
+		typedef std::vector<ClientQueue> Requests;
 		Requests requests;
+		ClientTable *table;
 		unsigned throughput_available, throughput_prop, throughput_system;
+		// proportional spacing depends on each client's weight and on
+		// these, as of the last time proportional clients joined or
+		// left. that bumps prop_epoch instead of rewriting every tag;
+		// a tag picks up its new spacing when it next advances.
+		unsigned prop_available, prop_total, prop_system;
+		uint32_t prop_epoch;
 		int64_t size;
 		int64_t virtual_clock;
+		int64_t idle_ttl;
+		unsigned purge_batch;
+		bool trace; // print tags on every dequeue
+		// serve backlogged clients whose tags are not yet due rather
+		// than idle the device
+		bool work_conserving;
+		// ticks to hold the device for a reserved client that just
+		// ran dry, 0 for none
+		int64_t anticipation;
+		size_t anticipated; // that client's id, or NIL
+		// idle slots anticipation may still spend: one comes back per
+		// dispatch, up to anticipation
+		int64_t anticipation_budget;
+		uint64_t idle_cycles;
+		Depth *depth;
+		ItemPool *pool;
+		unsigned device; // which of the front end's devices, in Item::priority
+		MergeHook *merge;
+		unsigned merge_max; // requests per dispatch
 
 		// data structure for dmClock
 		enum tag_types_t {
-			Q_NONE = -1, Q_RESERVE = 0, Q_PROP, Q_LIMIT, Q_COUNT
+			Q_NONE = -1, Q_RESERVE = 0, Q_PROP, Q_LIMIT, Q_SPARE, Q_COUNT
+		};
+
+		static const size_t NIL = (size_t) -1;
+
+		// tags are fixed point clock ticks with TAG_SHIFT fractional
+		// bits. a spacing is step + rem/den tag units; the remainder is
+		// carried from one advance to the next so that long-run rates
+		// are exact instead of drifting with rounding error.
+		typedef int64_t tag_t;
+		enum {
+			TAG_SHIFT = 16, PROP_DEN_SHIFT = 16
+		};
+
+		struct Spacing {
+			tag_t step;
+			uint32_t rem, den;
+			Spacing() :
+					step(0), rem(0), den(1) {
+			}
+		};
+
+		// tags are rebased once the clock gets this far, well before
+		// clock << TAG_SHIFT can overflow.
+		static int64_t epoch_limit() {
+			return (int64_t) 1 << (62 - TAG_SHIFT);
+		}
+
+		static Spacing make_spacing(uint64_t throughput, uint64_t rate) {
+			assert(rate && rate <= UINT32_MAX);
+			Spacing s;
+			uint64_t num = throughput << TAG_SHIFT;
+			s.step = num / rate;
+			s.rem = num % rate;
+			s.den = rate;
+			return s;
+		}
+
+		static Spacing make_spacing(double_t spacing) {
+			Spacing s;
+			uint64_t fixed = (uint64_t) (spacing
+					* (double_t) ((uint64_t) 1 << (TAG_SHIFT + PROP_DEN_SHIFT))
+					+ 0.5);
+			s.step = fixed >> PROP_DEN_SHIFT;
+			s.rem = fixed & ((1 << PROP_DEN_SHIFT) - 1);
+			s.den = 1 << PROP_DEN_SHIFT;
+			return s;
+		}
+
+		// one tag: its deadline, spacing and carried remainder
+		struct TagClock {
+			tag_t deadline;
+			Spacing spacing;
+			uint32_t carry;
+			TagClock() :
+					deadline(0), carry(0) {
+			}
+		};
+
+		static void advance(TagClock &c) {
+			c.deadline += c.spacing.step;
+			c.carry += c.spacing.rem;
+			if (c.carry >= c.spacing.den) {
+				c.carry -= c.spacing.den;
+				c.deadline++;
+			}
+		}
+
+		static void advance(TagClock &c, unsigned n) {
+			while (n--)
+				advance(c);
+		}
+
+		// undo one advance(). a deadline that would reach 0, which
+		// means the tag is off, stops at 1: as early as a tag can be.
+		static void retreat(TagClock &c) {
+			if (c.deadline <= c.spacing.step + 1) {
+				c.deadline = 1;
+				c.carry = 0;
+				return;
+			}
+			c.deadline -= c.spacing.step;
+			if (c.carry >= c.spacing.rem) {
+				c.carry -= c.spacing.rem;
+			} else {
+				c.carry += c.spacing.den - c.spacing.rem;
+				c.deadline--;
+			}
+		}
+
+		static void retreat(TagClock &c, unsigned n) {
+			while (n--)
+				retreat(c);
+		}
+
+		// advance, but never leave the deadline behind now
+		static void advance_to(TagClock &c, tag_t now) {
+			advance(c);
+			if (c.deadline < now) {
+				c.deadline = now;
+				c.carry = 0;
+			}
+		}
+
+		// a Tag stores only the clocks Policy enables. a disabled tag
+		// shares slot 0 and always reads as deadline 0, i.e. unused, so
+		// code guarded by its deadline folds away.
+		enum {
+			R_ON = Policy::RESERVE,
+			P_ON = Policy::PROP,
+			L_ON = Policy::LIMIT,
+			R_SLOT = 0,
+			P_SLOT = P_ON ? R_ON : 0,
+			L_SLOT = L_ON ? R_ON + P_ON : 0,
+			TAG_SLOTS = R_ON + P_ON + L_ON
 		};
 
+		static double_t tag_to_double(tag_t t) {
+			return (double_t) t / (1 << TAG_SHIFT);
+		}
+
 		struct Tag {
-			double_t r_deadline, r_spacing;
-			double_t p_deadline, p_spacing;
-			double_t l_deadline, l_spacing;
+			TagClock clk[TAG_SLOTS];
 			bool active;
+			bool in_use;
 			tag_types_t selected_tag;
-			K cl;
+			uint32_t id; // client id, indexes requests
 			SLO slo;
 			double_t stat;
+			int64_t idle_since;
+			int wheel_pos; // timer wheel slot while limit throttled, or -1
+			uint32_t p_epoch; // prop_epoch p().spacing was computed in
+			size_t prev, next; // TagList links
+
+			Tag(uint32_t _id, SLO _slo) :
+					active(true), in_use(true), selected_tag(Q_NONE), id(_id), slo(
+							_slo), stat(0), idle_since(0), wheel_pos(-1), p_epoch(0), prev(
+							NIL), next(NIL) {
+			}
 
-			Tag(K _cl, SLO _slo) :
-					r_deadline(0), r_spacing(0), p_deadline(0), p_spacing(0), l_deadline(
-							0), l_spacing(0), active(true), selected_tag(
-							Q_NONE), cl(_cl), slo(_slo), stat(0) {
+			TagClock &r() {
+				return clk[R_SLOT];
 			}
-			Tag(utime_t t) :
-					r_deadline(t), r_spacing(0), p_deadline(t), p_spacing(0), l_deadline(
-							t), l_spacing(0), active(true), selected_tag(
-							Q_NONE), stat(0) {
+			TagClock &p() {
+				return clk[P_SLOT];
 			}
-
-			Tag(int64_t t) :
-					r_deadline(t), r_spacing(0), p_deadline(t), p_spacing(0), l_deadline(
-							t), l_spacing(0), active(true), selected_tag(
-							Q_NONE), stat(0) {
+			TagClock &l() {
+				return clk[L_SLOT];
+			}
+			tag_t r_deadline() const {
+				return R_ON ? clk[R_SLOT].deadline : 0;
+			}
+			tag_t p_deadline() const {
+				return P_ON ? clk[P_SLOT].deadline : 0;
+			}
+			tag_t l_deadline() const {
+				return L_ON ? clk[L_SLOT].deadline : 0;
 			}
 
 		};
 		typedef std::vector<Tag> Schedule;
+
+		// an idle client keeps only what update_idle_tag() needs to
+		// bring its tags back, plus what reclaiming and checkpointing
+		// it take. spacings are recomputed from the SLO on promotion.
+		struct ColdTag {
+			SLO slo;
+			tag_t deadline[TAG_SLOTS];
+			uint32_t carry[TAG_SLOTS];
+			uint32_t id;
+			int64_t idle_since;
+			double_t stat;
+			size_t prev, next; // idle_clients links
+
+			tag_t r_deadline() const {
+				return R_ON ? deadline[R_SLOT] : 0;
+			}
+			tag_t p_deadline() const {
+				return P_ON ? deadline[P_SLOT] : 0;
+			}
+			tag_t l_deadline() const {
+				return L_ON ? deadline[L_SLOT] : 0;
+			}
+		};
+		typedef std::vector<ColdTag> ColdTable;
+
+		// backlogged clients only, so the array the scheduler scans
+		// stays small. a client is moved to cold when its FIFO runs dry
+		// and back when it is next queued to, both O(1), and gets
+		// whichever slot is free; its cl_index is only stable while it
+		// is backlogged.
 		Schedule schedule;
+		std::vector<size_t> free_slots;
+		ColdTable cold;
+		std::vector<size_t> free_cold;
+
+		// intrusive doubly linked list threaded through the prev/next
+		// of Tags (eligible, wheel) or ColdTags (idle_clients)
+		struct TagList {
+			size_t head, tail;
+			size_t count;
+			TagList() :
+					head(NIL), tail(NIL), count(0) {
+			}
+			bool empty() const {
+				return count == 0;
+			}
+		};
+
+		template<class V>
+		static void list_link(V &v, TagList &l, size_t i) {
+			v[i].prev = l.tail;
+			v[i].next = NIL;
+			if (l.tail != NIL)
+				v[l.tail].next = i;
+			else
+				l.head = i;
+			l.tail = i;
+			l.count++;
+		}
+
+		template<class V>
+		static void list_unlink(V &v, TagList &l, size_t i) {
+			if (v[i].prev != NIL)
+				v[v[i].prev].next = v[i].next;
+			else
+				l.head = v[i].next;
+			if (v[i].next != NIL)
+				v[v[i].next].prev = v[i].prev;
+			else
+				l.tail = v[i].prev;
+			v[i].prev = v[i].next = NIL;
+			l.count--;
+		}
+
+		void list_push_back(TagList &l, size_t i) {
+			list_link(schedule, l, i);
+		}
+
+		void list_erase(TagList &l, size_t i) {
+			list_unlink(schedule, l, i);
+		}
+
+		// idle clients, oldest first
+		TagList idle_clients;
+
+		// every active client is either eligible, or parked in the timer
+		// wheel until its limit deadline comes due. only the eligible
+		// list is searched for the next reservation/proportional tag.
+		TagList eligible;
+
+		// hierarchical timing wheel keyed by limit deadline. level n
+		// slots are WHEEL_SLOTS^n ticks wide; deadlines beyond the last
+		// level wait in the overflow slot.
+		enum {
+			WHEEL_BITS = 6,
+			WHEEL_SLOTS = 1 << WHEEL_BITS,
+			WHEEL_LEVELS = 4,
+			WHEEL_OVERFLOW = WHEEL_LEVELS * WHEEL_SLOTS
+		};
+		struct TimerWheel {
+			TagList slot[WHEEL_OVERFLOW + 1];
+		};
+		TimerWheel wheel;
+
+		static int64_t limit_tick(tag_t l_deadline) {
+			return (l_deadline + (1 << TAG_SHIFT) - 1) >> TAG_SHIFT;
+		}
+
+		void wheel_insert(size_t i) {
+			Tag &tag = schedule[i];
+			int64_t expires = limit_tick(tag.l_deadline());
+			int64_t delta = expires - virtual_clock;
+			int pos = WHEEL_OVERFLOW;
+			for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+				if (delta < ((int64_t) 1 << (WHEEL_BITS * (lvl + 1)))) {
+					pos = lvl * WHEEL_SLOTS
+							+ ((expires >> (WHEEL_BITS * lvl)) & (WHEEL_SLOTS - 1));
+					break;
+				}
+			}
+			tag.wheel_pos = pos;
+			list_push_back(wheel.slot[pos], i);
+		}
+
+		void wheel_erase(size_t i) {
+			Tag &tag = schedule[i];
+			list_erase(wheel.slot[tag.wheel_pos], i);
+			tag.wheel_pos = -1;
+		}
+
+		// put an active client on the eligible list or in the wheel
+		void schedule_active(size_t i) {
+			if (limit_tick(schedule[i].l_deadline()) > virtual_clock)
+				wheel_insert(i);
+			else
+				list_push_back(eligible, i);
+		}
+
+		void unschedule_active(size_t i) {
+			if (schedule[i].wheel_pos >= 0)
+				wheel_erase(i);
+			else
+				list_erase(eligible, i);
+		}
+
+		// empty a wheel slot, re-filing each client one level down or
+		// onto the eligible list once its limit deadline has passed.
+		void wheel_cascade(int pos) {
+			TagList l = wheel.slot[pos];
+			wheel.slot[pos] = TagList();
+			size_t next;
+			for (size_t i = l.head; i != NIL; i = next) {
+				Tag &tag = schedule[i];
+				next = tag.next;
+				tag.prev = tag.next = NIL;
+				tag.wheel_pos = -1;
+				schedule_active(i);
+			}
+		}
+
+		// called once for every tick of virtual_clock
+		void wheel_advance() {
+			int64_t now = virtual_clock;
+			for (int lvl = 1; lvl <= WHEEL_LEVELS; lvl++) {
+				if (now & (((int64_t) 1 << (WHEEL_BITS * lvl)) - 1))
+					break;
+				if (lvl == WHEEL_LEVELS)
+					wheel_cascade(WHEEL_OVERFLOW);
+				else
+					wheel_cascade(
+							lvl * WHEEL_SLOTS
+									+ ((now >> (WHEEL_BITS * lvl))
+											& (WHEEL_SLOTS - 1)));
+			}
+			wheel_cascade(now & (WHEEL_SLOTS - 1));
+		}
 
 		struct Deadline {
 			size_t cl_index;
-			double_t deadline;
+			tag_t deadline;
 			bool valid;
 			Deadline() :
 					cl_index(0), deadline(0), valid(false) {
 			}
-			void set_values(size_t ci, double_t d, bool v = true) {
+			void set_values(size_t ci, tag_t d, bool v = true) {
 				cl_index = ci;
 				deadline = d;
 				valid = v;
 			}
 		};
 		Deadline min_tag_r, min_tag_p;
+		DispatchWindow window;
+		Charge last_charge; // what the latest dispatch charged
+
+		// on-disk checkpoint of the tag table. deadlines are stored
+		// relative to the clock at save time, so a restore can rebase
+		// them onto whatever clock the new instance is running. any
+		// other version is refused: version 2 records carried spacings
+		// that nothing read back.
+		enum {
+			CHECKPOINT_MAGIC = 0x4b434d44, // "DMCK"
+			CHECKPOINT_VERSION = 3
+		};
 
-		void create_new_tag(K cl, SLO slo) {
-			Tag tag(cl, slo);
-			if (slo.reserve) {
-				tag.r_deadline = get_current_clock();
-				tag.r_spacing = (double_t) get_system_throughput()
-						/ slo.reserve;
+		struct CheckpointHeader {
+			uint32_t magic;
+			uint32_t version;
+			uint32_t record_size;
+			uint32_t throughput_available;
+			uint32_t throughput_prop;
+			uint32_t throughput_system;
+			uint64_t count;
+		};
+
+		// records hold the key by value, so K must be a POD: one that
+		// owns memory elsewhere, like std::string, would be written out
+		// as a pointer. checked when a checkpoint is saved or loaded.
+		struct CheckpointRecord {
+			K cl;
+			SLO slo;
+			tag_t r_deadline, p_deadline, l_deadline;
+			uint32_t r_carry, p_carry, l_carry;
+			double_t stat;
+		};
+
+		static void check_key_pod() {
+#if __cplusplus >= 201103L
+			static_assert(std::is_trivially_copyable<K>::value,
+					"checkpoint keys are written by value");
+#else
+			// before C++11 a union member may not have a constructor,
+			// destructor or assignment of its own
+			union KeyMustBePod {
+				K cl;
+			};
+#endif
+		}
+
+		static tag_t rebase_deadline(tag_t rel, tag_t now) {
+			tag_t d = rel + now;
+			return d > 0 ? d : 1;
+		}
+
+		size_t create_new_tag(uint32_t id, SLO slo) {
+			Tag tag(id, slo);
+			tag_t now = get_current_tag();
+			assert(R_ON || !slo.reserve);
+			assert(P_ON || !slo.prop);
+			assert(L_ON || !slo.limit);
+			if (R_ON && slo.reserve) {
+				tag.r().deadline = now;
+				tag.r().spacing = make_spacing(get_system_throughput(),
+						slo.reserve);
 				reserve_throughput(slo.reserve);
 			}
-			if (slo.limit) {
+			if (L_ON && slo.limit) {
 				assert(slo.limit > slo.reserve);
-				tag.l_deadline = get_current_clock();
-				tag.l_spacing = (double_t) get_system_throughput() / slo.limit;
+				tag.l().deadline = now;
+				tag.l().spacing = make_spacing(get_system_throughput(),
+						slo.limit);
 			}
 
-			if (slo.prop) {
+			if (P_ON && slo.prop) {
 				reserve_prop_throughput(slo.prop);
-				double_t prop = calculate_prop_throughput(slo.prop);
-				assert(prop > 0);
-				tag.p_spacing = (double_t) get_system_throughput() / prop;
-				tag.p_deadline =
-						min_tag_p.deadline ?
-								min_tag_p.deadline : get_current_clock();
-
 				recalculate_prop_throughput();
+				tag.p().spacing = prop_spacing(slo.prop);
+				tag.p_epoch = prop_epoch;
+				tag.p().deadline = min_tag_p.deadline ? min_tag_p.deadline : now;
 			}
-			schedule.push_back(tag);
-			update_min_deadlines();
+			size_t index = alloc_slot(tag);
+			schedule_active(index);
+			add_min_deadlines(index);
+			table->ref(id);
+			return index;
+		}
+
+		size_t alloc_slot(const Tag &tag) {
+			size_t index;
+			if (free_slots.empty()) {
+				index = schedule.size();
+				schedule.push_back(tag);
+			} else {
+				index = free_slots.back();
+				free_slots.pop_back();
+				schedule[index] = tag;
+			}
+			return index;
+		}
+
+		size_t alloc_cold() {
+			if (free_cold.empty()) {
+				cold.push_back(ColdTag());
+				return cold.size() - 1;
+			}
+			size_t c = free_cold.back();
+			free_cold.pop_back();
+			return c;
+		}
+
+		// file an idle tag away as cold record c, at the back of
+		// idle_clients
+		void freeze(const Tag &tag, size_t c) {
+			ColdTag &ct = cold[c];
+			ct.slo = tag.slo;
+			for (int i = 0; i < TAG_SLOTS; i++) {
+				ct.deadline[i] = tag.clk[i].deadline;
+				ct.carry[i] = tag.clk[i].carry;
+			}
+			ct.id = tag.id;
+			ct.idle_since = tag.idle_since;
+			ct.stat = tag.stat;
+			list_link(cold, idle_clients, c);
+			requests[tag.id].cold = c;
+		}
+
+		// the idle Tag a cold record stands for. its p spacing is left
+		// stale, to be recomputed on its next charge like any other
+		// tag that missed a change in proportional shares.
+		Tag thaw(const ColdTag &ct) const {
+			Tag tag(ct.id, ct.slo);
+			for (int i = 0; i < TAG_SLOTS; i++) {
+				tag.clk[i].deadline = ct.deadline[i];
+				tag.clk[i].carry = ct.carry[i];
+			}
+			if (R_ON && ct.slo.reserve)
+				tag.r().spacing = make_spacing(throughput_system, ct.slo.reserve);
+			if (P_ON && ct.slo.prop)
+				tag.p_epoch = prop_epoch - 1;
+			if (L_ON && ct.slo.limit)
+				tag.l().spacing = make_spacing(throughput_system, ct.slo.limit);
+			tag.idle_since = ct.idle_since;
+			tag.stat = ct.stat;
+			tag.active = false;
+			return tag;
+		}
+
+		// move a client that just went idle out of schedule
+		void demote(size_t cl_index) {
+			Tag &tag = schedule[cl_index];
+			assert(!tag.active);
+			freeze(tag, alloc_cold());
+			requests[tag.id].cl_index = NIL;
+			tag.in_use = false;
+			free_slots.push_back(cl_index);
+		}
+
+		// and back into whichever slot is free, still idle.
+		// update_idle_tag() makes it active.
+		size_t promote(size_t c) {
+			size_t index = alloc_slot(thaw(cold[c]));
+			list_unlink(cold, idle_clients, c);
+			free_cold.push_back(c);
+			requests[cold[c].id].cl_index = index;
+			requests[cold[c].id].cold = NIL;
+			return index;
 		}
 
-		void update_active_tag(size_t cl_index) {
+		void refresh_prop_spacing(Tag *tag) {
+			if (tag->p_epoch != prop_epoch) {
+				tag->p().spacing = prop_spacing(tag->slo.prop);
+				tag->p_epoch = prop_epoch;
+			}
+		}
+
+		// charge the client for n requests just dispatched
+		void update_active_tag(size_t cl_index, unsigned n = 1) {
 			Tag *tag = &schedule[cl_index];
 
-			if (tag->selected_tag == Q_RESERVE) {
-				if (tag->r_deadline)
-					tag->r_deadline = tag->r_deadline + tag->r_spacing;
+			if (tag->selected_tag == Q_RESERVE || tag->selected_tag == Q_SPARE) {
+				if (tag->r_deadline())
+					advance(tag->r(), n);
 			}
-			if (tag->p_deadline) {
-				tag->p_deadline = tag->p_deadline + tag->p_spacing;
+			if (tag->p_deadline()) {
+				refresh_prop_spacing(tag);
+				advance(tag->p(), n);
 			}
-			if (tag->l_deadline) {
-				tag->l_deadline = tag->l_deadline + tag->l_spacing;
+			if (tag->l_deadline()) {
+				advance(tag->l(), n);
+				if (tag->active && limit_tick(tag->l_deadline()) > virtual_clock) {
+					list_erase(eligible, cl_index);
+					wheel_insert(cl_index);
+				}
 			}
 			update_min_deadlines();
 		}
 
 		// a separate function to update idle tags
 		// for better performance.
-		void update_idle_tag(size_t cl_index) {
-			int64_t now = get_current_clock();
+		void update_idle_tag(size_t cl_index, bool resumed = false) {
+			tag_t now = get_current_tag();
 			Tag *tag = &schedule[cl_index];
 			tag->active = true;
 
-			if (tag->r_deadline) {
-				tag->r_deadline = std::max((tag->r_deadline + tag->r_spacing),
-						(double_t) now);
-			}
-			if (tag->p_deadline) {
-				tag->p_deadline = min_tag_p.deadline ? min_tag_p.deadline : now;
+			// a client back within its anticipation window carries on
+			// with its tags as if it had never gone idle, except that
+			// it banks no credit for the gap
+			if (anticipated == tag->id) {
+				if (virtual_clock - tag->idle_since < anticipation)
+					resumed = true;
+				anticipated = NIL;
 			}
-			if (tag->l_deadline) {
-				tag->l_deadline = std::max((tag->l_deadline + tag->l_spacing),
-						(double_t) now);
+			if (resumed) {
+				if (tag->r_deadline() && tag->r().deadline < now)
+					tag->r().deadline = now;
+			} else {
+				if (tag->r_deadline()) {
+					advance_to(tag->r(), now);
+				}
+				if (tag->p_deadline()) {
+					tag->p().deadline =
+							min_tag_p.deadline ? min_tag_p.deadline : now;
+					tag->p().carry = 0;
+				}
+				if (tag->l_deadline()) {
+					advance_to(tag->l(), now);
+				}
 			}
-			update_min_deadlines();
+			schedule_active(cl_index);
+			add_min_deadlines(cl_index);
 		}
 
+		// throttled clients sit in the wheel, so everything on the
+		// eligible list has l_deadline <= now. ties go to the highest
+		// client id, which slots no longer follow.
 		void update_min_deadlines() {
 			min_tag_r.valid = min_tag_p.valid = false;
-			size_t index = 0;
-			for (typename Schedule::iterator it = schedule.begin();
-					it != schedule.end(); ++it, index++) {
-				Tag tag = *it;
-				if (!tag.active)
-					continue;
+			for (size_t index = eligible.head; index != NIL;
+					index = schedule[index].next)
+				fold_min_deadlines(index);
+		}
 
-				if (tag.r_deadline
-						&& ((tag.r_deadline >= tag.l_deadline)
-								|| (tag.l_deadline <= get_current_clock()))) {
-					if (min_tag_r.valid) {
-						if (min_tag_r.deadline >= tag.r_deadline)
-							min_tag_r.set_values(index, tag.r_deadline);
-					} else {
-						min_tag_r.set_values(index, tag.r_deadline);
-					}
-				}
+		void fold_min_deadlines(size_t index) {
+			const Tag &tag = schedule[index];
 
-				if (tag.p_deadline && (tag.l_deadline <= get_current_clock())) {
-					if (min_tag_p.valid) {
-						if (min_tag_p.deadline >= tag.p_deadline)
-							min_tag_p.set_values(index, tag.p_deadline);
-					} else {
-						min_tag_p.set_values(index, tag.p_deadline);
-					}
-				}
+			tag_t r = tag.r_deadline();
+			if (r) {
+				if (!min_tag_r.valid || r < min_tag_r.deadline
+						|| (r == min_tag_r.deadline
+								&& tag.id > schedule[min_tag_r.cl_index].id))
+					min_tag_r.set_values(index, r);
 			}
+
+			tag_t p = tag.p_deadline();
+			if (p) {
+				if (!min_tag_p.valid || p < min_tag_p.deadline
+						|| (p == min_tag_p.deadline
+								&& tag.id > schedule[min_tag_p.cl_index].id))
+					min_tag_p.set_values(index, p);
+			}
+		}
+
+		// a client just joined the eligible list and nothing else
+		// moved, so the minima only need to take it into account
+		void add_min_deadlines(size_t index) {
+			if (schedule[index].wheel_pos < 0)
+				fold_min_deadlines(index);
 		}
 
 		void issue_idle_cycle() {
 			//#ifdef DEBUG
-			cout << get_current_clock() << "____idle_____" << "\t" << "\n";
-			print_current_tag(Q_NONE);
+			if (trace) {
+				cout << get_current_clock() << "____idle_____" << "\t" << "\n";
+				print_current_tag(Q_NONE);
+			}
 			//#endif
+			if (anticipating())
+				anticipation_budget--;
+			idle_cycles++;
 			increment_clock();
 			update_min_deadlines();
 		}
 
+		// hold off other work while a reserved client that went idle
+		// less than anticipation ticks ago may still return, but only
+		// while it is behind its reservation and the idle budget lasts.
+		// a client that has had its reservation takes its turn with
+		// everyone else.
+		bool anticipating() const {
+			if (anticipated == NIL || requests[anticipated].cold == NIL
+					|| anticipation_budget <= 0)
+				return false;
+			const ColdTag &ct = cold[requests[anticipated].cold];
+			return virtual_clock < ct.idle_since + anticipation
+					&& ct.r_deadline() <= get_current_tag();
+		}
+
 		double_t calculate_prop_throughput(double_t prop) const {
-			if (throughput_prop && prop) {
-				if (prop <= throughput_prop)
-					return throughput_available * (prop / throughput_prop);
+			if (prop_total && prop) {
+				if (prop <= prop_total)
+					return prop_available * (prop / prop_total);
 				else
-					return throughput_available;
+					return prop_available;
 			}
 			return 0;
 		}
 
+		Spacing prop_spacing(double_t prop) const {
+			double_t t = calculate_prop_throughput(prop);
+			assert(t > 0);
+			return make_spacing((double_t) prop_system / t);
+		}
+
+		// O(1): tags catch up lazily, see prop_epoch
 		void recalculate_prop_throughput() {
-			double_t prop;
-			for (typename Schedule::iterator it = schedule.begin();
-					it != schedule.end(); ++it) {
-				if (it->slo.prop) {
-					prop = calculate_prop_throughput(it->slo.prop);
-					assert(prop > 0);
-					it->p_spacing = (double_t) get_system_throughput() / prop;
-				}
-			}
+			if (!P_ON)
+				return;
+			prop_available = throughput_available;
+			prop_total = throughput_prop;
+			prop_system = throughput_system;
+			prop_epoch++;
 		}
 
-		bool get_client_index(K cl, size_t &index) {
-			bool is_found = false;
-			for (typename Schedule::iterator it = schedule.begin();
-					it != schedule.end(); ++it) {
-				if (it->cl == cl) {
-					index = it - schedule.begin();
-					is_found = true;
+		bool get_client_index(uint32_t id, size_t &index) {
+			if (id >= requests.size() || requests[id].cl_index == NIL)
+				return false;
+			index = requests[id].cl_index;
+			return true;
+		}
+
+		// the client's FIFO ran dry. its tags are still charged for the
+		// request that emptied it before demote() files it away.
+		void set_idle(size_t cl_index) {
+			Tag *tag = &schedule[cl_index];
+			if (tag->active)
+				unschedule_active(cl_index);
+			tag->active = false;
+			tag->idle_since = get_current_clock();
+		}
+
+		// drop an idle client and recycle its cold record, and its id
+		// if nothing else holds it. returns true if the proportional
+		// shares of the remaining clients changed.
+		bool release_client(size_t c) {
+			ColdTag &ct = cold[c];
+			if (ct.slo.reserve)
+				release_throughput(ct.slo.reserve);
+			if (ct.slo.prop)
+				release_prop_throughput(ct.slo.prop);
+			list_unlink(cold, idle_clients, c);
+			requests[ct.id].cold = NIL;
+			if (anticipated == ct.id)
+				anticipated = NIL;
+			free_cold.push_back(c);
+			table->unref(ct.id);
+			return ct.slo.prop != 0;
+		}
+
+		// reclaim up to max clients that have been idle for longer
+		// than idle_ttl. idle_clients is ordered by idle_since, so we
+		// only ever look at its head.
+		void reclaim_idle_clients(unsigned max) {
+			if (!idle_ttl)
+				return;
+			int64_t now = get_current_clock();
+			bool update_required = false;
+			for (unsigned n = 0; n < max && !idle_clients.empty(); n++) {
+				size_t index = idle_clients.head;
+				if (cold[index].idle_since + idle_ttl > now)
 					break;
-				}
+				update_required |= release_client(index);
 			}
-			return is_found;
+			if (update_required)
+				recalculate_prop_throughput();
 		}
 
 		//helper function
 		void print_iops() {
+			if (!trace)
+				return;
 			std::cout << "throughput at " << virtual_clock << ":\n";
-			for (size_t i = 0; i < schedule.size(); i++)
-				std::cout << "\t client " << i << " IOPS :" << schedule[i].stat
-						<< std::endl;
+			for (size_t i = 0; i < requests.size(); i++) {
+				const ClientQueue &cq = requests[i];
+				if (cq.cl_index != NIL)
+					std::cout << "\t client " << i << " IOPS :"
+							<< schedule[cq.cl_index].stat << std::endl;
+				else if (cq.cold != NIL)
+					std::cout << "\t client " << i << " IOPS :"
+							<< cold[cq.cold].stat << std::endl;
+			}
 		}
 		// helper function
 		void print_current_tag(tag_types_t tt, int index = -1) {
+			if (!trace)
+				return;
 			cout << get_current_clock() << "\t";
-			for (typename Schedule::iterator it = schedule.begin();
-					it != schedule.end(); ++it) {
-				Tag _tag = *it;
-				if (index == (it - schedule.begin())) {
+			for (typename Requests::const_iterator it = requests.begin();
+					it != requests.end(); ++it) {
+				tag_t r, p, l;
+				if (it->cl_index != NIL) {
+					const Tag &_tag = schedule[it->cl_index];
+					r = _tag.r_deadline();
+					p = _tag.p_deadline();
+					l = _tag.l_deadline();
+				} else if (it->cold != NIL) {
+					const ColdTag &_tag = cold[it->cold];
+					r = _tag.r_deadline();
+					p = _tag.p_deadline();
+					l = _tag.l_deadline();
+				} else {
+					continue;
+				}
+				if (index >= 0 && it->cl_index == (size_t) index) {
 					if (tt == Q_RESERVE)
 						std::cout << "*";
 					if (tt == Q_PROP)
 						std::cout << "~";
 					if (tt == Q_LIMIT)
 						std::cout << "_";
+					if (tt == Q_SPARE)
+						std::cout << "+";
 				}
-				std::cout << _tag.r_deadline << "\t " << _tag.p_deadline
-						<< " \t " << _tag.l_deadline << " \t || ";
+				std::cout << tag_to_double(r) << "\t " << tag_to_double(p)
+						<< " \t " << tag_to_double(l) << " \t || ";
 			}
 			std::cout << std::endl;
 		}
 
-	public:
-		SubQueueDMClock(const SubQueueDMClock &other) :
-				requests(other.requests), throughput_available(
-						other.throughput_available), throughput_prop(
-						other.throughput_prop), throughput_system(
-						other.throughput_system), size(other.size), schedule(
-						other.schedule), virtual_clock(other.virtual_clock) {
+	public:
+		SubQueueDMClock(const SubQueueDMClock &other) :
+				requests(other.requests), table(other.table), throughput_available(
+						other.throughput_available), throughput_prop(
+						other.throughput_prop), throughput_system(
+						other.throughput_system), prop_available(
+						other.prop_available), prop_total(other.prop_total), prop_system(
+						other.prop_system), prop_epoch(other.prop_epoch), size(
+						other.size), virtual_clock(
+						other.virtual_clock), idle_ttl(other.idle_ttl), purge_batch(
+						other.purge_batch), trace(other.trace), work_conserving(
+						other.work_conserving), anticipation(other.anticipation), anticipated(
+						other.anticipated), anticipation_budget(
+						other.anticipation_budget), idle_cycles(other.idle_cycles), depth(
+						other.depth), pool(
+						other.pool), device(other.device), merge(other.merge), merge_max(
+						other.merge_max), schedule(
+						other.schedule), free_slots(
+						other.free_slots), cold(other.cold), free_cold(
+						other.free_cold), idle_clients(other.idle_clients), eligible(
+						other.eligible), wheel(other.wheel), min_tag_r(
+						other.min_tag_r), min_tag_p(other.min_tag_p), window(
+						other.window), last_charge(other.last_charge) {
+		}
+
+		SubQueueDMClock() :
+				table(NULL), throughput_available(0), throughput_prop(0), throughput_system(
+						0), prop_available(0), prop_total(0), prop_system(0), prop_epoch(
+						0), size(0), virtual_clock(1), idle_ttl(0), purge_batch(
+						8), trace(true), work_conserving(false), anticipation(0), anticipated(
+						NIL), anticipation_budget(0), idle_cycles(0), depth(NULL), pool(NULL), device(0), merge(NULL), merge_max(1) {
+		}
+
+		void set_depth(Depth *d) {
+			depth = d;
+		}
+
+		void set_pool(ItemPool *p, unsigned d) {
+			pool = p;
+			device = d;
+		}
+
+		void set_table(ClientTable *t) {
+			table = t;
+		}
+
+		// take the trace, idle, merge and work conserving settings
+		// from another device's queue
+		void configure_like(const SubQueueDMClock &o) {
+			trace = o.trace;
+			work_conserving = o.work_conserving;
+			anticipation = o.anticipation;
+			anticipation_budget = o.anticipation;
+			idle_ttl = o.idle_ttl;
+			purge_batch = o.purge_batch;
+			merge = o.merge;
+			merge_max = o.merge_max;
+		}
+
+		void set_merge(MergeHook *hook, unsigned max_ops) {
+			merge = hook;
+			merge_max = hook && max_ops > 1 ? max_ops : 1;
+		}
+
+		void set_trace(bool t) {
+			trace = t;
 		}
 
-		SubQueueDMClock() :
-				throughput_available(0), throughput_prop(0), throughput_system(
-						0), size(0), virtual_clock(1) {
+		void set_work_conserving(bool wc, int64_t window) {
+			work_conserving = wc;
+			anticipation = window;
+			anticipation_budget = window;
+			if (!anticipation)
+				anticipated = NIL;
+		}
+
+		uint64_t get_idle_cycles() const {
+			return idle_cycles;
+		}
+
+		const Charge &get_last_charge() const {
+			return last_charge;
+		}
+
+		DispatchWindow &get_window() {
+			return window;
+		}
+		const DispatchWindow &get_window() const {
+			return window;
+		}
+
+		// clients idle for more than ttl clock ticks are reclaimed, at
+		// most batch of them per enqueue/dequeue. a ttl of 0 leaves
+		// reclamation to purge_idle_clients().
+		void set_idle_ttl(int64_t ttl, unsigned batch) {
+			idle_ttl = ttl;
+			purge_batch = batch;
 		}
 
 		int64_t get_current_clock() {
 			return virtual_clock;
 		}
 
+		tag_t get_current_tag() const {
+			return (tag_t) virtual_clock << TAG_SHIFT;
+		}
+
+		// move the clock and every tag back by a whole number of timer
+		// wheel spans. parked clients keep their wheel slots, and
+		// deadlines far enough in the past are pinned just above zero.
+		void renormalize() {
+			const int64_t span = (int64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS);
+			int64_t offset = ((virtual_clock - 1) / span) * span;
+			if (!offset)
+				return;
+			tag_t toff = (tag_t) offset << TAG_SHIFT;
+			for (typename Schedule::iterator it = schedule.begin();
+					it != schedule.end(); ++it) {
+				if (!it->in_use)
+					continue;
+				if (it->r_deadline())
+					it->r().deadline = rebase_deadline(it->r().deadline, -toff);
+				if (it->p_deadline())
+					it->p().deadline = rebase_deadline(it->p().deadline, -toff);
+				if (it->l_deadline())
+					it->l().deadline = rebase_deadline(it->l().deadline, -toff);
+				it->idle_since -= offset;
+			}
+			for (size_t c = idle_clients.head; c != NIL; c = cold[c].next) {
+				for (int i = 0; i < TAG_SLOTS; i++)
+					if (cold[c].deadline[i])
+						cold[c].deadline[i] = rebase_deadline(cold[c].deadline[i],
+								-toff);
+				cold[c].idle_since -= offset;
+			}
+			if (min_tag_r.deadline)
+				min_tag_r.deadline = rebase_deadline(min_tag_r.deadline, -toff);
+			if (min_tag_p.deadline)
+				min_tag_p.deadline = rebase_deadline(min_tag_p.deadline, -toff);
+			virtual_clock -= offset;
+		}
+
 		int64_t increment_clock() {
 			if ((virtual_clock % throughput_system) == 0) {
 				print_iops();
 			}
-			return ++virtual_clock;
+			++virtual_clock;
+			if (virtual_clock >= epoch_limit())
+				renormalize();
+			wheel_advance();
+			return virtual_clock;
 		}
 
 		void set_system_throughput(unsigned mt) {
 			throughput_system = mt;
 		}
 
+		// change the capacity tags are spaced against. reservations and
+		// limits keep their rates, so every spacing is recomputed. cold
+		// clients get theirs when they are promoted.
+		void rescale_throughput(unsigned mt) {
+			assert(mt);
+			unsigned reserved = throughput_system - throughput_available;
+			throughput_system = mt;
+			throughput_available = mt > reserved ? mt - reserved : 0;
+			for (typename Schedule::iterator it = schedule.begin();
+					it != schedule.end(); ++it) {
+				if (!it->in_use)
+					continue;
+				if (R_ON && it->slo.reserve)
+					it->r().spacing = make_spacing(mt, it->slo.reserve);
+				if (L_ON && it->slo.limit)
+					it->l().spacing = make_spacing(mt, it->slo.limit);
+			}
+			recalculate_prop_throughput();
+		}
+
 		unsigned get_system_throughput() const {
 			return throughput_system;
 		}
@@ -495,47 +2096,205 @@ class PrioritizedQueueDMClock {
 
 		void purge_idle_clients() {
 			bool update_required = false;
-			typename Schedule::iterator it = schedule.begin();
-			for (; it != schedule.end();) {
-				if (!it->active) {
-					update_required = true;
-					if (it->slo.reserve)
-						release_throughput(it->slo.reserve);
-					if (it->slo.prop)
-						release_prop_throughput(it->slo.prop);
-
-					print_iops(); //testing
-
-					requests.erase(it->cl);
-					it = schedule.erase(it);
-				} else {
-					++it;
-				}
-			}
+			while (!idle_clients.empty())
+				update_required |= release_client(idle_clients.head);
 			if (update_required)
 				recalculate_prop_throughput();
 		}
 
+		// write the tag table, SLOs and throughput accounting to
+		// path. queued requests are not saved; every client comes back
+		// idle and is reactivated through update_idle_tag().
+		int save_checkpoint(const char *path) const {
+			check_key_pod();
+			std::string tmp = std::string(path) + ".tmp";
+			FILE *fp = fopen(tmp.c_str(), "w");
+			if (!fp)
+				return -errno;
+
+			CheckpointHeader hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.magic = CHECKPOINT_MAGIC;
+			hdr.version = CHECKPOINT_VERSION;
+			hdr.record_size = sizeof(CheckpointRecord);
+			hdr.throughput_available = throughput_available;
+			hdr.throughput_prop = throughput_prop;
+			hdr.throughput_system = throughput_system;
+			for (typename Requests::const_iterator it = requests.begin();
+					it != requests.end(); ++it)
+				if (it->cl_index != NIL || it->cold != NIL)
+					hdr.count++;
+
+			// records go out in key order, so a checkpoint does not
+			// depend on the order clients were interned in.
+			bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+			for (typename ClientTable::Cursor it(*table); ok && !it.done();
+					it.next()) {
+				if (it.id() >= requests.size())
+					continue;
+				const ClientQueue &cq = requests[it.id()];
+				if (cq.cl_index == NIL && cq.cold == NIL)
+					continue;
+				const Tag tag =
+						cq.cl_index != NIL ? schedule[cq.cl_index] : thaw(cold[cq.cold]);
+				CheckpointRecord rec;
+				memset((void *) &rec, 0, sizeof(rec));
+				rec.cl = it.key();
+				rec.slo = tag.slo;
+				rec.r_deadline = tag.r_deadline() - get_current_tag();
+				rec.p_deadline = tag.p_deadline() - get_current_tag();
+				rec.l_deadline = tag.l_deadline() - get_current_tag();
+				if (R_ON)
+					rec.r_carry = tag.clk[R_SLOT].carry;
+				if (P_ON)
+					rec.p_carry = tag.clk[P_SLOT].carry;
+				if (L_ON)
+					rec.l_carry = tag.clk[L_SLOT].carry;
+				rec.stat = tag.stat;
+				ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+			}
+			if (ok)
+				ok = (fflush(fp) == 0) && (fsync(fileno(fp)) == 0);
+			int r = ok ? 0 : -errno;
+			if (fclose(fp) != 0 && r == 0)
+				r = -errno;
+			if (r == 0 && rename(tmp.c_str(), path) != 0)
+				r = -errno;
+			if (r < 0)
+				unlink(tmp.c_str());
+			return r;
+		}
+
+		// map a checkpoint written by save_checkpoint() and rebuild the
+		// tag table from it. only valid on a scheduler with no clients,
+		// and only if every saved SLO fits this scheduler's Policy.
+		int load_checkpoint(const char *path) {
+			check_key_pod();
+			if (!schedule.empty() || !cold.empty())
+				return -EBUSY;
+
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0)
+				return -errno;
+			struct stat st;
+			if (fstat(fd, &st) < 0) {
+				int r = -errno;
+				::close(fd);
+				return r;
+			}
+			size_t len = st.st_size;
+			if (len < sizeof(CheckpointHeader)) {
+				::close(fd);
+				return -EINVAL;
+			}
+			void *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (base == MAP_FAILED)
+				return -errno;
+			madvise(base, len, MADV_SEQUENTIAL);
+
+			const CheckpointHeader *hdr = (const CheckpointHeader *) base;
+			// count comes off disk: bound it before multiplying
+			if (hdr->magic != CHECKPOINT_MAGIC
+					|| hdr->version != CHECKPOINT_VERSION
+					|| hdr->record_size != sizeof(CheckpointRecord)
+					|| hdr->count
+							> (len - sizeof(*hdr)) / sizeof(CheckpointRecord)
+					|| len != sizeof(*hdr) + hdr->count * sizeof(CheckpointRecord)) {
+				munmap(base, len);
+				return -EINVAL;
+			}
+			// save_checkpoint() writes records in key order, which also
+			// rules out a key saved twice
+			const CheckpointRecord *rec = (const CheckpointRecord *) (hdr + 1);
+			uint64_t count = hdr->count;
+			for (uint64_t i = 0; i < count; i++) {
+				if ((!R_ON && rec[i].slo.reserve) || (!P_ON && rec[i].slo.prop)
+						|| (!L_ON && rec[i].slo.limit)
+						|| (i && !(rec[i - 1].cl < rec[i].cl))) {
+					munmap(base, len);
+					return -EINVAL;
+				}
+			}
+
+			throughput_available = hdr->throughput_available;
+			throughput_prop = hdr->throughput_prop;
+			throughput_system = hdr->throughput_system;
+			recalculate_prop_throughput();
+
+			// every client comes back cold, and the cold table is built
+			// in one pass, records appended in file order. into an empty
+			// client table, as on a restart, the keys go in the same
+			// way. spacings are recomputed from the SLOs on promotion.
+			tag_t now = get_current_tag();
+			bool bulk = table->empty();
+			table->reserve(count);
+			if (bulk)
+				table->sorted.reserve(count);
+			cold.reserve(count);
+			for (uint64_t i = 0; i < count; i++, rec++) {
+				ColdTag ct = ColdTag();
+				ct.id = bulk ?
+						table->intern_sorted(rec->cl) : table->intern(rec->cl);
+				ct.slo = rec->slo;
+				if (R_ON && rec->slo.reserve) {
+					ct.deadline[R_SLOT] = rebase_deadline(rec->r_deadline, now);
+					ct.carry[R_SLOT] = rec->r_carry;
+				}
+				if (P_ON && rec->slo.prop) {
+					ct.deadline[P_SLOT] = rebase_deadline(rec->p_deadline, now);
+					ct.carry[P_SLOT] = rec->p_carry;
+				}
+				if (L_ON && rec->slo.limit) {
+					ct.deadline[L_SLOT] = rebase_deadline(rec->l_deadline, now);
+					ct.carry[L_SLOT] = rec->l_carry;
+				}
+				ct.idle_since = get_current_clock();
+				ct.stat = rec->stat;
+				table->ref(ct.id);
+				cold.push_back(ct);
+				list_link(cold, idle_clients, i);
+			}
+			munmap(base, len);
+			if (table->keys.size() > requests.size())
+				requests.resize(table->keys.size());
+			for (size_t c = 0; c < cold.size(); c++)
+				requests[cold[c].id].cold = c;
+			return 0;
+		}
+
 		Tag* front(size_t &out) {
 			assert((size != 0));
-			int64_t t = get_current_clock();
+			tag_t t = get_current_tag();
 
 			if (min_tag_r.valid) {
 				Tag *tag = &schedule[min_tag_r.cl_index];
-				if (tag->r_deadline <= t) {
+				if (tag->r_deadline() <= t) {
 					tag->selected_tag = Q_RESERVE;
 					out = min_tag_r.cl_index;
 					return tag;
 				}
 			}
+			if (anticipating())
+				return NULL;
 			if (min_tag_p.valid) {
 				Tag *tag = &schedule[min_tag_p.cl_index];
-				if (tag->p_deadline) {
+				if (tag->p_deadline()) {
 					tag->selected_tag = Q_PROP;
 					out = min_tag_p.cl_index;
 					return tag;
 				}
 			}
+			// nothing is due: serve the earliest reservation ahead of
+			// time. it is charged as early reservation service, which
+			// splits spare slots in proportion to reservations. limit
+			// throttled clients are not on the eligible list.
+			if (work_conserving && min_tag_r.valid) {
+				Tag *tag = &schedule[min_tag_r.cl_index];
+				tag->selected_tag = Q_SPARE;
+				out = min_tag_r.cl_index;
+				return tag;
+			}
 			return NULL;
 		}
 
@@ -549,38 +2308,209 @@ class PrioritizedQueueDMClock {
 				issue_idle_cycle();
 				tag = front(cl_index);
 			}
+			return dispatch(tag, cl_index);
+		}
+
+		// pop only if the next request would be served in the
+		// proportional phase: no reservation is due and the client is
+		// not limit throttled. otherwise leave everything, the clock
+		// included, untouched and return false.
+		bool pop_front_prop(T *out) {
+			if (!size)
+				return false;
+			size_t cl_index;
+			Tag *tag = front(cl_index);
+			if (!tag || tag->selected_tag != Q_PROP)
+				return false;
+			*out = dispatch(tag, cl_index);
+			return true;
+		}
+
+		// one device slot: dispatch a request if one may go now, or
+		// else spend an idle cycle and return false
+		bool pop_front_once(T *out) {
+			size_t cl_index;
+			Tag *tag = size ? front(cl_index) : NULL;
+			if (!tag) {
+				issue_idle_cycle();
+				return false;
+			}
+			*out = dispatch(tag, cl_index);
+			return true;
+		}
 
+		// hand out the head of the selected client's FIFO and charge
+		// its tags
+		T dispatch(Tag *tag, size_t cl_index) {
 			//#ifdef DEBUG
 			print_current_tag(tag->selected_tag, cl_index);
 			tag->stat++;
 			//#endif
 
-			T ret = requests[tag->cl].front();
-			requests[tag->cl].pop_front();
-			if (requests[tag->cl].empty())
-				schedule[tag->cl].active = false;
+			ItemList &fifo = requests[tag->id].fifo;
+			uint32_t i = fifo.head;
+			T ret = (*pool)[i].item;
+			depth->sub(tag->id, 1, (*pool)[i].cost);
+			pool->erase(fifo, i);
+			pool->release(i);
+			// fold the requests queued behind it into the same dispatch
+			unsigned n = 1;
+			while (n < merge_max && !fifo.empty()
+					&& merge->can_merge(ret, (*pool)[fifo.head].item)) {
+				i = fifo.head;
+				merge->merge(ret, (*pool)[i].item);
+				depth->sub(tag->id, 1, (*pool)[i].cost);
+				pool->erase(fifo, i);
+				pool->release(i);
+				n++;
+			}
+			window.in_flight++;
+			if (anticipation_budget < anticipation)
+				anticipation_budget++;
+			if (fifo.empty()) {
+				set_idle(cl_index);
+				if (anticipation && tag->r_deadline())
+					anticipated = tag->id;
+			}
 
 			increment_clock();
-			update_active_tag(cl_index);
-			size--;
+			// front() also picks tags for peeks that charge nothing, so
+			// what a refund undoes is recorded here
+			last_charge.id = tag->id;
+			last_charge.tag = tag->selected_tag;
+			last_charge.n = n;
+			update_active_tag(cl_index, n);
+			if (!tag->active)
+				demote(cl_index);
+			size -= n;
+			reclaim_idle_clients(purge_batch);
 			return ret;
 		}
 
-		void enqueue(K cl, SLO slo, double cost, T item) {
-			bool new_cl = (requests.find(cl) == requests.end());
-			if (new_cl) {
-				create_new_tag(cl, slo);
+		// take back what the dispatch c was recorded for advanced the
+		// client's tags by, for all the requests merged into it. c is
+		// spent, so it is only refunded once.
+		void refund_tag(size_t cl_index, Charge &c) {
+			Tag *tag = &schedule[cl_index];
+			unsigned n = c.n;
+			assert(c.tag == Q_NONE || c.id == tag->id);
+			if (c.tag == Q_NONE)
+				return;
+			if (c.tag == Q_RESERVE || c.tag == Q_SPARE) {
+				if (tag->r_deadline())
+					retreat(tag->r(), n);
+			}
+			if (tag->p_deadline()) {
+				refresh_prop_spacing(tag);
+				retreat(tag->p(), n);
+			}
+			if (tag->l_deadline())
+				retreat(tag->l(), n);
+			c.tag = Q_NONE;
+			c.n = 0;
+			if (tag->active) {
+				// an earlier limit may take it out of the wheel
+				unschedule_active(cl_index);
+				schedule_active(cl_index);
+				add_min_deadlines(cl_index);
+			}
+		}
+
+		Handle push(uint32_t id, SLO slo, double cost, T item, bool front,
+				Charge *refund) {
+			if (id >= requests.size())
+				requests.resize(id + 1);
+			ClientQueue &cq = requests[id];
+			if (cq.cl_index == NIL && cq.cold == NIL) {
+				cq.cl_index = create_new_tag(id, slo);
 			} else {
-				if (requests[cl].empty()) {
-					size_t index = 0;
-					bool found = get_client_index(cl, index);
+				if (cq.cl_index == NIL)
+					promote(cq.cold);
+				// a client the refunded op had run dry comes back with
+				// its tags as they were before that dispatch
+				bool resume = refund && refund->tag != Q_NONE;
+				if (refund)
+					refund_tag(cq.cl_index, *refund);
+				if (!schedule[cq.cl_index].active) {
 					print_iops();
-					assert(found != false);
-					update_idle_tag(index);
+					update_idle_tag(cq.cl_index, false);
 				}
 			}
-			requests[cl].push_back(item);
+			uint32_t i = pool->alloc(item, cost, IN_DMCLOCK, cq.cl_index);
+			(*pool)[i].priority = device;
+			if (front)
+				pool->push_front(cq.fifo, i);
+			else
+				pool->push_back(cq.fifo, i);
 			size++;
+			depth->add(id, 1, cost);
+			// not before: reclaiming id's own cold record could recycle
+			// the id under us
+			reclaim_idle_clients(purge_batch);
+			return pool->handle(i);
+		}
+
+		Handle enqueue(uint32_t id, SLO slo, double cost, T item) {
+			return push(id, slo, cost, item, false, NULL);
+		}
+
+		// put a dispatched request back at the head of its client's
+		// FIFO, refunding the tags refund, if any, was charged for
+		Handle requeue(uint32_t id, SLO slo, double cost, T item,
+				Charge *refund) {
+			return push(id, slo, cost, item, true, refund);
+		}
+
+		// a client whose FIFO was emptied by a removal goes idle, and
+		// cold. the min deadlines only need recomputing if they pointed
+		// at it.
+		void removed_from(size_t cl_index, unsigned n, uint64_t cost) {
+			Tag *tag = &schedule[cl_index];
+			size -= n;
+			depth->sub(tag->id, n, cost);
+			if (!requests[tag->id].fifo.empty() || !tag->active)
+				return;
+			set_idle(cl_index);
+			if ((min_tag_r.valid && min_tag_r.cl_index == cl_index)
+					|| (min_tag_p.valid && min_tag_p.cl_index == cl_index))
+				update_min_deadlines();
+			demote(cl_index);
+		}
+
+		// clients are visited in key order, so what lands in out does
+		// not depend on the order they were interned in
+		template<class F>
+		void remove_by_filter(F f, std::list<T> *out) {
+			for (typename ClientTable::Cursor it(*table); !it.done(); it.next()) {
+				if (it.id() >= requests.size() || requests[it.id()].fifo.empty())
+					continue;
+				ClientQueue &cq = requests[it.id()];
+				uint64_t cost = 0;
+				unsigned n = pool->filter(cq.fifo, f, out, &cost);
+				if (n)
+					removed_from(cq.cl_index, n, cost);
+			}
+		}
+
+		void remove_by_class(uint32_t id, std::list<T> *out) {
+			if (id >= requests.size() || requests[id].fifo.empty())
+				return;
+			uint64_t cost = 0;
+			unsigned n = pool->clear(requests[id].fifo, out, &cost);
+			removed_from(requests[id].cl_index, n, cost);
+		}
+
+		// unlink the item h was issued for. tags are only charged on
+		// dequeue, so there is nothing to refund.
+		void cancel(uint32_t i, T *out) {
+			Item &item = (*pool)[i];
+			size_t cl_index = item.owner;
+			uint64_t cost = item.cost;
+			if (out)
+				*out = item.item;
+			pool->erase(requests[schedule[cl_index].id].fifo, i);
+			pool->release(i);
+			removed_from(cl_index, 1, cost);
 		}
 
 		unsigned length() const {
@@ -603,190 +2533,761 @@ class PrioritizedQueueDMClock {
 		//		}
 	};
 
-	typedef std::map<unsigned, SubQueue> SubQueues;
+	// priority classes live in a fixed table indexed by priority. bit p
+	// of nonempty is set while class p has items; bit p of eligible is
+	// set while its front item costs less than the tokens it holds, so
+	// both dequeue paths find their class with a single bit scan. the
+	// enqueue calls refuse a priority past the table with -EINVAL.
+	enum {
+		MAX_PRIORITIES = 64
+	};
+
+	struct SubQueues {
+		SubQueue q[MAX_PRIORITIES];
+		uint64_t nonempty, eligible;
+
+		SubQueues() :
+				nonempty(0), eligible(0) {
+		}
+		static uint64_t bit(unsigned p) {
+			return (uint64_t) 1 << p;
+		}
+		static unsigned lowest(uint64_t mask) {
+			return __builtin_ctzll(mask);
+		}
+		static unsigned highest(uint64_t mask) {
+			return MAX_PRIORITIES - 1 - __builtin_clzll(mask);
+		}
+		bool empty() const {
+			return nonempty == 0;
+		}
+		bool has(unsigned p) const {
+			return nonempty & bit(p);
+		}
+		SubQueue &operator[](unsigned p) {
+			assert(p < MAX_PRIORITIES);
+			return q[p];
+		}
+		const SubQueue &operator[](unsigned p) const {
+			assert(p < MAX_PRIORITIES);
+			return q[p];
+		}
+		// resync the bits for p after anything that may have changed
+		// its length, its front item or its tokens.
+		void update(unsigned p) {
+			SubQueue &sq = q[p];
+			if (sq.empty()) {
+				nonempty &= ~bit(p);
+				eligible &= ~bit(p);
+				return;
+			}
+			nonempty |= bit(p);
+			if (sq.front().first < sq.num_tokens())
+				eligible |= bit(p);
+			else
+				eligible &= ~bit(p);
+		}
+	};
 	SubQueues high_queue;
 	SubQueues queue;
 
-	SubQueueDMClock dm_queue;
+	// one dmClock queue per device, each with its own tags and
+	// capacity. device 0 is the one the mClock calls without a device
+	// use.
+	std::vector<SubQueueDMClock> dm_queues;
+
+	void attach_queues() {
+		for (unsigned p = 0; p < MAX_PRIORITIES; p++) {
+			queue[p].set_depth(&depth);
+			queue[p].set_pool(&pool, IN_QUEUE, p);
+			high_queue[p].set_depth(&depth);
+			high_queue[p].set_pool(&pool, IN_HIGH_QUEUE, p);
+		}
+		for (unsigned d = 0; d < dm_queues.size(); d++) {
+			dm_queues[d].set_depth(&depth);
+			dm_queues[d].set_pool(&pool, d);
+			dm_queues[d].set_table(&clients);
+		}
+		depth.table = &clients;
+	}
+
+	// for the calls that take a key: unlike intern_client(), the id is
+	// held only by what the call queues
+	ClientId key_id(const K &cl) {
+		return ClientId(clients.intern(cl));
+	}
 
 	SubQueue *create_queue(unsigned priority) {
-		typename SubQueues::iterator p = queue.find(priority);
-		if (p != queue.end())
-			return &p->second;
-		total_priority += priority;
 		SubQueue *sq = &queue[priority];
+		if (queue.has(priority))
+			return sq;
+		total_priority += priority;
 		sq->set_max_tokens(max_tokens_per_subqueue);
+		if (token_rate) {
+			clock.begin_pass();
+			sq->refill(clock.now(), 0);
+		}
 		return sq;
 	}
 
 	void remove_queue(unsigned priority) {
-		assert(queue.count(priority));
-		queue.erase(priority);
+		assert(queue.has(priority));
+		assert(queue[priority].empty());
+		queue[priority].clear_tokens();
+		queue.update(priority);
 		total_priority -= priority;
 		assert(total_priority >= 0);
 	}
 
 	void distribute_tokens(unsigned cost) {
-		if (total_priority == 0)
+		if (total_priority == 0 || token_rate)
 			return;
-		for (typename SubQueues::iterator i = queue.begin(); i != queue.end();
-				++i) {
-			i->second.put_tokens(((i->first * cost) / total_priority) + 1);
+		for (uint64_t m = queue.nonempty; m; m &= m - 1) {
+			unsigned p = SubQueues::lowest(m);
+			queue[p].put_tokens(((p * cost) / total_priority) + 1);
+			queue.update(p);
+		}
+	}
+
+	// time based refill only matters to classes that cannot run yet
+	void refill_tokens() {
+		utime_t now = clock.now();
+		for (uint64_t m = queue.nonempty & ~queue.eligible; m; m &= m - 1) {
+			unsigned p = SubQueues::lowest(m);
+			queue[p].refill(now, token_rate * p / total_priority);
+			queue.update(p);
 		}
 	}
 
 public:
 	PrioritizedQueueDMClock(unsigned max_per, unsigned min_c) :
-			total_priority(0), max_tokens_per_subqueue(max_per), min_cost(min_c) {
-		dm_queue.set_system_throughput(max_tokens_per_subqueue);
-		dm_queue.release_throughput(max_tokens_per_subqueue);
+			total_priority(0), max_tokens_per_subqueue(max_per), min_cost(min_c), token_rate(
+					0), dm_queues(1) {
+		dm_queues[0].set_system_throughput(max_tokens_per_subqueue);
+		dm_queues[0].release_throughput(max_tokens_per_subqueue);
+		attach_queues();
 	}
 
+	PrioritizedQueueDMClock(const PrioritizedQueueDMClock &other) :
+			total_priority(other.total_priority), max_tokens_per_subqueue(
+					other.max_tokens_per_subqueue), min_cost(other.min_cost), token_rate(
+					other.token_rate), clock(other.clock), clients(other.clients), depth(other.depth), pool(other.pool), intake(
+					other.intake), high_queue(
+					other.high_queue), queue(other.queue), dm_queues(
+					other.dm_queues) {
+		attach_queues();
+	}
+
+	// every queued item, including dmClock work held back by a full
+	// dispatch window; see dispatchable_length()
 	unsigned length() const {
-		unsigned total = 0;
-		for (typename SubQueues::const_iterator i = queue.begin();
-				i != queue.end(); ++i) {
-			assert(i->second.length());
-			total += i->second.length();
-		}
-		for (typename SubQueues::const_iterator i = high_queue.begin();
-				i != high_queue.end(); ++i) {
-			assert(i->second.length());
-			total += i->second.length();
-		}
-		total += dm_queue.length();
-		return total;
+		assert(depth.total >= 0);
+		return (unsigned) depth.total;
+	}
+
+	// the id for cl, assigning one the first time cl is seen. callers
+	// that enqueue for the same client repeatedly can keep the id and
+	// use the ClientId overloads, which skip the key lookup. each call
+	// holds the id until a matching release_client().
+	ClientId intern_client(const K &cl) {
+		uint32_t id = clients.intern(cl);
+		clients.ref(id);
+		return ClientId(id);
+	}
+
+	// the id may be reused once the client also has nothing queued
+	// and no dmClock tags left; its SLOs go with it
+	void release_client(ClientId id) {
+		clients.unref(id.id);
+	}
+
+	const K &client_key(ClientId id) const {
+		return clients.key(id.id);
+	}
+
+	// the id cl has now, without assigning one or holding it. false if
+	// the queue does not know cl.
+	bool find_client(const K &cl, ClientId *id) const {
+		return clients.find(cl, &id->id);
+	}
+
+	// items queued by cl across the strict, weighted and dmClock queues
+	unsigned client_length(ClientId id) const {
+		return depth.client(id.id);
+	}
+
+	unsigned client_length(const K &cl) const {
+		uint32_t id;
+		return clients.find(cl, &id) ? depth.client(id) : 0;
+	}
+
+	unsigned priority_length(unsigned priority) const {
+		if (priority >= MAX_PRIORITIES)
+			return 0;
+		return queue[priority].length() + high_queue[priority].length();
+	}
+
+	unsigned mClock_length(unsigned device = 0) const {
+		return dm_queues[device].length();
+	}
+
+	// the dmClock requests device could be handed before its dispatch
+	// window fills. length() and mClock_length() still count
+	// everything queued, whatever the window.
+	unsigned dispatchable_length(unsigned device = 0) const {
+		const DispatchWindow &w = dm_queues[device].get_window();
+		unsigned n = dm_queues[device].length();
+		if (!w.limit)
+			return n;
+		if (w.full())
+			return 0;
+		return std::min(n, w.limit - w.in_flight);
+	}
+
+	unsigned get_mClock_throughput(unsigned device = 0) const {
+		return dm_queues[device].get_system_throughput();
+	}
+
+	// resize the dmClock queue's share of the device, e.g. when a
+	// front end moves capacity between schedulers
+	void set_mClock_throughput(unsigned throughput, unsigned device = 0) {
+		dm_queues[device].rescale_throughput(throughput);
+	}
+
+	// add a device with its own dmClock tags, spaced against
+	// throughput, and return its index. clients, their ids and SLOs
+	// and admission control stay shared; a client only gets a tag on
+	// the devices it sends work to. settings made with the
+	// set_mClock_* calls are copied from device 0.
+	unsigned add_mClock_device(unsigned throughput) {
+		assert(dm_queues.size() < 256); // must fit Item::priority
+		dm_queues.push_back(SubQueueDMClock());
+		SubQueueDMClock &dq = dm_queues.back();
+		dq.configure_like(dm_queues[0]);
+		dq.set_system_throughput(throughput);
+		dq.release_throughput(throughput);
+		attach_queues();
+		return dm_queues.size() - 1;
+	}
+
+	unsigned mClock_devices() const {
+		return dm_queues.size();
+	}
+
+	// the SLO id holds on device, used by the enqueue_mClock calls
+	// that name a device. a client that already has a tag there keeps
+	// its old SLO until it is reclaimed as idle.
+	void set_mClock_slo(ClientId id, unsigned device, const SLO &slo) {
+		clients.set_slo(id.id, device, slo);
 	}
 
 	template<class F>
 	void remove_by_filter(F f, std::list<T> *removed = 0) {
-		for (typename SubQueues::iterator i = queue.begin(); i != queue.end();
-				) {
-			unsigned priority = i->first;
-
-			i->second.remove_by_filter(f, removed);
-			if (i->second.empty()) {
-				++i;
+		for (uint64_t m = queue.nonempty; m; m &= m - 1) {
+			unsigned priority = SubQueues::lowest(m);
+			queue[priority].remove_by_filter(f, removed);
+			if (queue[priority].empty())
 				remove_queue(priority);
-			} else {
-				++i;
-			}
+			else
+				queue.update(priority);
 		}
-		for (typename SubQueues::iterator i = high_queue.begin();
-				i != high_queue.end();) {
-			i->second.remove_by_filter(f, removed);
-			if (i->second.empty()) {
-				high_queue.erase(i++);
-			} else {
-				++i;
-			}
+		for (uint64_t m = high_queue.nonempty; m; m &= m - 1) {
+			unsigned priority = SubQueues::lowest(m);
+			high_queue[priority].remove_by_filter(f, removed);
+			high_queue.update(priority);
 		}
+		for (unsigned d = 0; d < dm_queues.size(); d++)
+			dm_queues[d].remove_by_filter(f, removed);
 	}
 
-	void remove_by_class(K k, std::list<T> *out = 0) {
-		for (typename SubQueues::iterator i = queue.begin(); i != queue.end();
-				) {
-			i->second.remove_by_class(k, out);
-			if (i->second.empty()) {
-				unsigned priority = i->first;
-				++i;
+	void remove_by_class(const K &cl, std::list<T> *out = 0) {
+		uint32_t id;
+		if (clients.find(cl, &id))
+			remove_by_class(ClientId(id), out);
+	}
+
+	void remove_by_class(ClientId id, std::list<T> *out = 0) {
+		uint32_t k = id.id;
+		for (uint64_t m = queue.nonempty; m; m &= m - 1) {
+			unsigned priority = SubQueues::lowest(m);
+			queue[priority].remove_by_class(k, out);
+			if (queue[priority].empty())
 				remove_queue(priority);
-			} else {
-				++i;
-			}
+			else
+				queue.update(priority);
 		}
-		for (typename SubQueues::iterator i = high_queue.begin();
-				i != high_queue.end();) {
-			i->second.remove_by_class(k, out);
-			if (i->second.empty()) {
-				high_queue.erase(i++);
-			} else {
-				++i;
-			}
+		for (uint64_t m = high_queue.nonempty; m; m &= m - 1) {
+			unsigned priority = SubQueues::lowest(m);
+			high_queue[priority].remove_by_class(k, out);
+			high_queue.update(priority);
+		}
+		for (unsigned d = 0; d < dm_queues.size(); d++)
+			dm_queues[d].remove_by_class(k, out);
+	}
+
+	// remove a single item given the handle its enqueue returned.
+	// returns -ENOENT if it has already left the queue.
+	int cancel(const Handle &h, T *out = NULL) {
+		if (!pool.valid(h))
+			return -ENOENT;
+		unsigned p = pool[h.index].priority;
+		switch (pool[h.index].where) {
+		case IN_DMCLOCK:
+			dm_queues[p].cancel(h.index, out);
+			break;
+		case IN_QUEUE:
+			queue[p].cancel(h.index, out);
+			if (queue[p].empty())
+				remove_queue(p);
+			else
+				queue.update(p);
+			break;
+		case IN_HIGH_QUEUE:
+			high_queue[p].cancel(h.index, out);
+			high_queue.update(p);
+			break;
+		default:
+			assert(0 == "unknown queue");
 		}
+		return 0;
+	}
+
+	// the enqueue functions fill in *handle, when given, for cancel()
+	// the priority enqueues return -EINVAL, queueing nothing, for a
+	// priority of MAX_PRIORITIES or more
+	int enqueue_strict(K cl, unsigned priority, T item,
+			Handle *handle = NULL) {
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
+		return enqueue_strict(key_id(cl), priority, item, handle);
+	}
+
+	int enqueue_strict(ClientId id, unsigned priority, T item,
+			Handle *handle = NULL) {
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
+		Handle h = high_queue[priority].enqueue(id.id, 0, item);
+		high_queue.update(priority);
+		if (handle)
+			*handle = h;
+		return 0;
+	}
+
+	int enqueue_strict_front(K cl, unsigned priority, T item,
+			Handle *handle = NULL) {
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
+		return enqueue_strict_front(key_id(cl), priority, item, handle);
 	}
 
-	void enqueue_strict(K cl, unsigned priority, T item) {
-		high_queue[priority].enqueue(cl, 0, item);
+	int enqueue_strict_front(ClientId id, unsigned priority, T item,
+			Handle *handle = NULL) {
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
+		Handle h = high_queue[priority].enqueue_front(id.id, 0, item);
+		high_queue.update(priority);
+		if (handle)
+			*handle = h;
+		return 0;
 	}
 
-	void enqueue_strict_front(K cl, unsigned priority, T item) {
-		high_queue[priority].enqueue_front(cl, 0, item);
+	// returns 0, or a negative error from Depth::admit() if the item
+	// was refused. strict and front enqueues bypass admission control:
+	// they carry control traffic and requeued work that can't be
+	// dropped.
+	int enqueue(K cl, unsigned priority, unsigned cost, T item,
+			Handle *handle = NULL) {
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
+		return enqueue(key_id(cl), priority, cost, item, handle);
 	}
 
-	void enqueue(K cl, unsigned priority, unsigned cost, T item) {
+	int enqueue(ClientId id, unsigned priority, unsigned cost, T item,
+			Handle *handle = NULL) {
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
 		if (cost < min_cost)
 			cost = min_cost;
 		if (cost > max_tokens_per_subqueue)
 			cost = max_tokens_per_subqueue;
-		create_queue(priority)->enqueue(cl, cost, item);
+		int r = depth.admit(id.id, cost);
+		if (r < 0)
+			return r;
+		Handle h = create_queue(priority)->enqueue(id.id, cost, item);
+		queue.update(priority);
+		if (handle)
+			*handle = h;
+		return 0;
+	}
+
+	int enqueue_front(K cl, unsigned priority, unsigned share, T item,
+			Handle *handle = NULL) {
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
+		return enqueue_front(key_id(cl), priority, share, item, handle);
 	}
 
-	void enqueue_front(K cl, unsigned priority, unsigned share, T item) { // 1/share internally
+	int enqueue_front(ClientId id, unsigned priority, unsigned share, T item,
+			Handle *handle = NULL) { // 1/share internally
+		if (priority >= MAX_PRIORITIES)
+			return -EINVAL;
 		if (share < min_cost)
 			share = min_cost;
 		if (share > max_tokens_per_subqueue)
 			share = max_tokens_per_subqueue;
 
-		create_queue(priority)->enqueue_front(cl, share, item);
+		Handle h = create_queue(priority)->enqueue_front(id.id, share, item);
+		queue.update(priority);
+		if (handle)
+			*handle = h;
+		return 0;
+	}
+
+	// refill the weighted queues from elapsed time instead of from the
+	// cost of each dequeue. every class gets its priority's share of
+	// tokens_per_sec, computed lazily when dequeue() looks at it. 0
+	// restores per-dequeue distribution.
+	void set_token_refill_rate(double_t tokens_per_sec) {
+		token_rate = tokens_per_sec;
+		if (token_rate) {
+			clock.begin_pass();
+			utime_t now = clock.now();
+			for (uint64_t m = queue.nonempty; m; m &= m - 1)
+				queue[SubQueues::lowest(m)].refill(now, 0);
+		}
+	}
+
+	// serve the classes within each weighted priority by deficit round
+	// robin on item cost instead of one item per class per turn, so
+	// that a class sending large ops gets the same share of cost as
+	// one sending small ones. strict queues carry no cost and are
+	// unaffected.
+	void set_deficit_round_robin(bool on) {
+		for (unsigned p = 0; p < MAX_PRIORITIES; p++) {
+			queue[p].set_drr(on);
+			if (queue.has(p))
+				queue.update(p);
+		}
+	}
+
+	// time source for token refill, one of the CEPH_CLOCK_* sources in
+	// Clock.h. defaults to CLOCK_MONOTONIC so that a step of the wall
+	// clock can't hand out or withhold a burst of tokens.
+	void set_clock_source(int source) {
+		clock.set_source(source);
+		if (token_rate)
+			set_token_refill_rate(token_rate);
 	}
 
 	bool empty() const {
 		assert(total_priority >= 0);
-		assert((total_priority == 0) || !(queue.empty()));
-		return queue.empty() && high_queue.empty() && dm_queue.empty();
+		return depth.total == 0 && !intake.ready();
 	}
 
-	T dequeue_mClock() {
-		assert(!(dm_queue.empty()));
+	// a worker for device only ever sees that device's work. the
+	// device's dispatch window must not be full. with charge, what the
+	// op cost its client is stored there for requeue_mClock().
+	T dequeue_mClock(unsigned device = 0, Charge *charge = NULL) {
+		fold_intake();
+		assert(!(dm_queues[device].empty()));
+		assert(!dm_queues[device].get_window().full());
 		// ceph_clock_now(NULL);
-		return dm_queue.pop_front();
+		T ret = dm_queues[device].pop_front();
+		if (charge)
+			*charge = dm_queues[device].get_last_charge();
+		return ret;
+	}
+
+	// dequeue from device on behalf of another worker. only
+	// proportional-phase work is given out, so reservations and
+	// limits are still met by this queue's own dequeues. returns
+	// -EAGAIN if nothing qualifies and -EBUSY if the device's dispatch
+	// window is full.
+	int steal_mClock(T *out, unsigned device = 0, Charge *charge = NULL) {
+		fold_intake();
+		if (dm_queues[device].get_window().full())
+			return -EBUSY;
+		if (!dm_queues[device].pop_front_prop(out))
+			return -EAGAIN;
+		if (charge)
+			*charge = dm_queues[device].get_last_charge();
+		return 0;
+	}
+
+	// non-blocking dequeue for callers that model device time: each
+	// call is one slot, either a dispatch or an idle cycle, in which
+	// case -EAGAIN is returned. returns -EBUSY, without using the slot,
+	// while the device's dispatch window is full.
+	int try_dequeue_mClock(T *out, unsigned device = 0, Charge *charge =
+			NULL) {
+		fold_intake();
+		if (dm_queues[device].get_window().full())
+			return -EBUSY;
+		if (!dm_queues[device].pop_front_once(out))
+			return -EAGAIN;
+		if (charge)
+			*charge = dm_queues[device].get_last_charge();
+		return 0;
+	}
+
+	// cap the dmClock requests in flight at device at limit, 0 for no
+	// cap. every dmClock dequeue counts as dispatched; the caller
+	// reports each one back with mClock_completed().
+	void set_mClock_window(unsigned limit, unsigned device = 0) {
+		DispatchWindow &w = dm_queues[device].get_window();
+		w.limit = limit;
+		w.target = 0;
+	}
+
+	// let the cap float between min_limit and max_limit, keeping the
+	// latency passed to mClock_completed() under target
+	void set_mClock_adaptive_window(uint64_t target, unsigned min_limit,
+			unsigned max_limit, unsigned device = 0) {
+		assert(target && min_limit && min_limit <= max_limit);
+		DispatchWindow &w = dm_queues[device].get_window();
+		w.target = target;
+		w.min_limit = min_limit;
+		w.max_limit = max_limit;
+		if (w.limit < min_limit || w.limit > max_limit)
+			w.limit = min_limit;
+		w.acked = 0;
+		w.late = false;
+	}
+
+	// work the caller sent to device without dequeueing it here, e.g.
+	// strict items; it takes a place in the window all the same
+	void mClock_dispatched(unsigned device = 0) {
+		dm_queues[device].get_window().in_flight++;
+	}
+
+	// a request to device finished, latency after it was dispatched
+	void mClock_completed(uint64_t latency = 0, unsigned device = 0) {
+		dm_queues[device].get_window().completed(latency);
+	}
+
+	unsigned get_mClock_in_flight(unsigned device = 0) const {
+		return dm_queues[device].get_window().in_flight;
+	}
+
+	unsigned get_mClock_window(unsigned device = 0) const {
+		return dm_queues[device].get_window().limit;
+	}
+
+	// in work conserving mode a slot that would otherwise idle goes
+	// to the backlogged client with the earliest reservation tag,
+	// even though it is not yet due. a non-zero anticipation holds
+	// the device for up to that many ticks after a reserved client
+	// runs dry while it is behind its reservation, so that a client
+	// issuing dependent requests is not cut off. at most that many
+	// slots go idle this way back to back, and on average no more
+	// than one per request dispatched.
+	void set_mClock_work_conserving(bool wc, int64_t anticipation = 0) {
+		for (unsigned d = 0; d < dm_queues.size(); d++)
+			dm_queues[d].set_work_conserving(wc, anticipation);
+	}
+
+	// hand out up to max_ops of a client's requests, queued back to
+	// back, as one dmClock dequeue, merged by hook for as long as its
+	// can_merge() agrees. the client is charged for each request
+	// merged, so its share does not change; the device sees fewer,
+	// larger ops. NULL or a max_ops of 1 turns merging off.
+	void set_mClock_merge(MergeHook *hook, unsigned max_ops) {
+		for (unsigned d = 0; d < dm_queues.size(); d++)
+			dm_queues[d].set_merge(hook, max_ops);
+	}
+
+	uint64_t get_mClock_idle_cycles(unsigned device = 0) const {
+		return dm_queues[device].get_idle_cycles();
+	}
+
+	// stage a request from any thread without touching the scheduler.
+	// it is queued by the next dequeue_mClock/steal_mClock, skipping
+	// admission control: the ring's capacity bounds staged work. the
+	// ring carries keys, since only the consumer may intern them.
+	// returns -EAGAIN if the ring is full and -EINVAL if
+	// set_mClock_intake() was not called. devices must all be added
+	// before anyone stages.
+	int stage_mClock(K cl, struct SLO slo, unsigned cost, T item,
+			unsigned device = 0) {
+		if (!intake.enabled())
+			return -EINVAL;
+		assert(device < dm_queues.size());
+		return intake.push(cl, device, slo, cost, item);
+	}
+
+	// give the dmClock queue a staging ring of (at least) capacity
+	// entries; 0 removes it. call before any producer starts.
+	void set_mClock_intake(unsigned capacity) {
+		fold_intake();
+		intake.resize(capacity);
 	}
 
-	void enqueue_mClock(K cl, struct SLO slo, unsigned cost, T item) {
-		dm_queue.enqueue(cl, slo, cost, item);
+	// stage_mClock calls refused because the ring was full
+	uint64_t get_mClock_intake_overflows() const {
+		return intake.overflows;
+	}
+
+	// move everything published on the ring into the device queues
+	// it was staged for. consumer side only.
+	void fold_intake() {
+		K cl;
+		unsigned device;
+		SLO slo;
+		unsigned cost;
+		T item;
+		while (intake.pop(&cl, &device, &slo, &cost, &item))
+			dm_queues[device].enqueue(clients.intern(cl), slo, cost, item);
+	}
+
+	int enqueue_mClock(K cl, struct SLO slo, unsigned cost, T item,
+			Handle *handle = NULL) {
+		return enqueue_mClock(key_id(cl), slo, cost, item, handle);
+	}
+
+	int enqueue_mClock(ClientId id, struct SLO slo, unsigned cost, T item,
+			Handle *handle = NULL) {
+		int r = depth.admit(id.id, cost);
+		if (r < 0)
+			return r;
+		Handle h = dm_queues[0].enqueue(id.id, slo, cost, item);
+		if (handle)
+			*handle = h;
+		return 0;
+	}
+
+	// put item, dequeued from the dmClock queue but needing a retry
+	// (object locked, waiting on peering), back at the head of its
+	// client's FIFO. like the other front enqueues this skips
+	// admission control. with refund, the charge its dequeue stored
+	// there is taken back, so the retry does not use up the client's
+	// reservation or push out its deadlines. a client the op had run
+	// dry gets its tags back as they were. each charge is refunded
+	// once. the item keeps its place in the dispatch window until it
+	// is reported with mClock_completed().
+	void requeue_mClock(K cl, struct SLO slo, unsigned cost, T item,
+			Charge *refund = NULL, Handle *handle = NULL) {
+		requeue_mClock(key_id(cl), slo, cost, item, refund, handle);
+	}
+
+	void requeue_mClock(ClientId id, struct SLO slo, unsigned cost, T item,
+			Charge *refund = NULL, Handle *handle = NULL) {
+		Handle h = dm_queues[0].requeue(id.id, slo, cost, item, refund);
+		if (handle)
+			*handle = h;
+	}
+
+	// requeue_mClock() for device, under the SLO set_mClock_slo() gave
+	// id there. returns -ENOENT if it has none.
+	int requeue_mClock(ClientId id, unsigned device, unsigned cost, T item,
+			Charge *refund = NULL, Handle *handle = NULL) {
+		assert(device < dm_queues.size());
+		const SLO *slo = clients.slo(id.id, device);
+		if (!slo)
+			return -ENOENT;
+		Handle h = dm_queues[device].requeue(id.id, *slo, cost, item, refund);
+		if (handle)
+			*handle = h;
+		return 0;
+	}
+
+	// queue item for device under the SLO set_mClock_slo() gave id
+	// there. returns -ENOENT if it has none, or an error from
+	// Depth::admit().
+	int enqueue_mClock(ClientId id, unsigned device, unsigned cost, T item,
+			Handle *handle = NULL) {
+		assert(device < dm_queues.size());
+		const SLO *slo = clients.slo(id.id, device);
+		if (!slo)
+			return -ENOENT;
+		int r = depth.admit(id.id, cost);
+		if (r < 0)
+			return r;
+		Handle h = dm_queues[device].enqueue(id.id, *slo, cost, item);
+		if (handle)
+			*handle = h;
+		return 0;
+	}
+
+	void set_admission_limits(const AdmissionLimits &limits) {
+		depth.limits = limits;
+	}
+
+	void set_admission_listener(AdmissionListener *listener) {
+		depth.listener = listener;
+	}
+
+	void set_client_listener(ClientListener *listener) {
+		clients.listener = listener;
 	}
 
 	void purge_mClock() {
-		dm_queue.purge_idle_clients();
+		for (unsigned d = 0; d < dm_queues.size(); d++)
+			dm_queues[d].purge_idle_clients();
+	}
+
+	void set_mClock_idle_ttl(int64_t ttl, unsigned batch = 8) {
+		for (unsigned d = 0; d < dm_queues.size(); d++)
+			dm_queues[d].set_idle_ttl(ttl, batch);
+	}
+
+	// the per-dequeue tag dump is on by default
+	void set_mClock_trace(bool trace) {
+		for (unsigned d = 0; d < dm_queues.size(); d++)
+			dm_queues[d].set_trace(trace);
+	}
+
+	int checkpoint_mClock(const char *path, unsigned device = 0) const {
+		return dm_queues[device].save_checkpoint(path);
+	}
+
+	int restore_mClock(const char *path, unsigned device = 0) {
+		return dm_queues[device].load_checkpoint(path);
 	}
 
 	T dequeue() {
 		assert(!empty());
+		clock.begin_pass();
 
 		if (!(high_queue.empty())) {
-			T ret = high_queue.rbegin()->second.front().second;
-			high_queue.rbegin()->second.pop_front();
-			if (high_queue.rbegin()->second.empty())
-				high_queue.erase(high_queue.rbegin()->first);
+			unsigned priority = SubQueues::highest(high_queue.nonempty);
+			SubQueue &sq = high_queue[priority];
+			T ret = sq.front().second;
+			sq.pop_front();
+			high_queue.update(priority);
 			return ret;
 		}
 
 		// if there are multiple buckets/subqueues with sufficient tokens,
 		// we behave like a strict priority queue among all subqueues that
 		// are eligible to run.
-		for (typename SubQueues::iterator i = queue.begin(); i != queue.end();
-				++i) {
-			assert(!(i->second.empty()));
-			if (i->second.front().first < i->second.num_tokens()) {
-				T ret = i->second.front().second;
-				unsigned cost = i->second.front().first;
-				i->second.take_tokens(cost);
-				i->second.pop_front();
-				if (i->second.empty())
-					remove_queue(i->first);
-				distribute_tokens(cost);
-				return ret;
-			}
+		if (token_rate)
+			refill_tokens();
+		if (queue.eligible) {
+			unsigned priority = SubQueues::lowest(queue.eligible);
+			SubQueue &sq = queue[priority];
+			T ret = sq.front().second;
+			unsigned cost = sq.front().first;
+			sq.take_tokens(cost);
+			sq.pop_front();
+			if (sq.empty())
+				remove_queue(priority);
+			else
+				queue.update(priority);
+			distribute_tokens(cost);
+			return ret;
 		}
 
 		// if no subqueues have sufficient tokens, we behave like a strict
 		// priority queue.
-		T ret = queue.rbegin()->second.front().second;
-		unsigned cost = queue.rbegin()->second.front().first;
-		queue.rbegin()->second.pop_front();
-		if (queue.rbegin()->second.empty())
-			remove_queue(queue.rbegin()->first);
+		unsigned priority = SubQueues::highest(queue.nonempty);
+		SubQueue &sq = queue[priority];
+		T ret = sq.front().second;
+		unsigned cost = sq.front().first;
+		sq.pop_front();
+		if (sq.empty())
+			remove_queue(priority);
+		else
+			queue.update(priority);
 		distribute_tokens(cost);
 		return ret;
 	}
@@ -796,20 +3297,20 @@ public:
 //		f->dump_int("max_tokens_per_subqueue", max_tokens_per_subqueue);
 //		f->dump_int("min_cost", min_cost);
 //		f->open_array_section("high_queues");
-//		for (typename SubQueues::const_iterator p = high_queue.begin();
-//				p != high_queue.end(); ++p) {
+//		for (uint64_t m = high_queue.nonempty; m; m &= m - 1) {
+//			unsigned p = SubQueues::lowest(m);
 //			f->open_object_section("subqueue");
-//			f->dump_int("priority", p->first);
-//			p->second.dump(f);
+//			f->dump_int("priority", p);
+//			high_queue[p].dump(f);
 //			f->close_section();
 //		}
 //		f->close_section();
 //		f->open_array_section("queues");
-//		for (typename SubQueues::const_iterator p = queue.begin();
-//				p != queue.end(); ++p) {
+//		for (uint64_t m = queue.nonempty; m; m &= m - 1) {
+//			unsigned p = SubQueues::lowest(m);
 //			f->open_object_section("subqueue");
-//			f->dump_int("priority", p->first);
-//			p->second.dump(f);
+//			f->dump_int("priority", p);
+//			queue[p].dump(f);
 //			f->close_section();
 //		}
 //		f->close_section();
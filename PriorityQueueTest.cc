@@ -4,14 +4,22 @@
  *  Created on: Jun 25, 2015
  *      Author: sbillah
  */
+// the tests check with assert, whatever the build says
+#undef NDEBUG
 #include <iostream>
 #include <assert.h>
 #include "PrioritizedQueueDMClock.h"
+#include "NumaDMClock.h"
 #include <string>
 #include "utime.h"
-//#include "Clock.h"
+#include "Clock.h"
 #include <iomanip>
 #include <queue>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <list>
 
 using namespace std;
 
@@ -22,8 +30,2604 @@ using namespace std;
 //	return n;
 //}
 
+static double now_sec() {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+// ns per dequeue with every client backlogged, so that each pop goes
+// through tag update and selection
+template<typename Policy>
+static double bench_dequeue(const SLO &slo, unsigned clients, unsigned depth) {
+	PrioritizedQueueDMClock<unsigned, unsigned, Policy> q(100000, 10);
+	q.set_mClock_trace(false);
+	for (unsigned j = 0; j < depth; j++)
+		for (unsigned c = 0; c < clients; c++)
+			q.enqueue_mClock(c, slo, 0, c);
+	unsigned n = q.mClock_length() / 2;
+	double start = now_sec();
+	for (unsigned i = 0; i < n; i++)
+		q.dequeue_mClock();
+	return (now_sec() - start) * 1e9 / n;
+}
+
+static int bench_policy(unsigned clients) {
+	SLO prop, rl;
+	prop.reserve = 0;
+	prop.prop = 10;
+	prop.limit = 0;
+	rl.reserve = 50;
+	rl.prop = 0;
+	rl.limit = 1000;
+
+	cout << clients << " clients, ns per dequeue" << endl;
+	cout << "proportional only:   full "
+			<< bench_dequeue<DMClockFull>(prop, clients, 4)
+			<< "\tDMClockPropOnly "
+			<< bench_dequeue<DMClockPropOnly>(prop, clients, 4) << endl;
+	cout << "reservation + limit: full "
+			<< bench_dequeue<DMClockFull>(rl, clients, 4)
+			<< "\tDMClockReserveLimit "
+			<< bench_dequeue<DMClockReserveLimit>(rl, clients, 4) << endl;
+	return 0;
+}
+
+// producers enqueue into either one scheduler behind one lock or one
+// shard per node. without real sockets the nodes are simulated, which
+// measures the locking but not the interconnect traffic.
+struct NumaBench {
+	NumaTopology *topo;
+	NumaDMClock<unsigned, unsigned> *numa;
+	PrioritizedQueueDMClock<unsigned, unsigned> *global;
+	pthread_mutex_t *global_lock;
+	unsigned id, ops, weight;
+};
+
+static void *numa_producer(void *arg) {
+	NumaBench *b = (NumaBench *) arg;
+	unsigned node = b->id % b->topo->nodes();
+	b->topo->bind_thread(node);
+	SLO slo;
+	slo.reserve = 10;
+	slo.prop = 10;
+	slo.limit = 0;
+	for (unsigned i = 0; i < b->ops * b->weight; i++) {
+		unsigned cl = b->id * 64 + i % 64;
+		if (b->numa) {
+			if (i < 64)
+				b->numa->bind_client(cl, node);
+			b->numa->enqueue_mClock(cl, slo, 0, i);
+		} else {
+			pthread_mutex_lock(b->global_lock);
+			b->global->enqueue_mClock(cl, slo, 0, i);
+			pthread_mutex_unlock(b->global_lock);
+		}
+	}
+	return NULL;
+}
+
+static double run_numa_producers(NumaTopology &topo,
+		NumaDMClock<unsigned, unsigned> *numa,
+		PrioritizedQueueDMClock<unsigned, unsigned> *global,
+		unsigned producers, unsigned ops, bool skew) {
+	pthread_mutex_t lock;
+	pthread_mutex_init(&lock, NULL);
+	vector<NumaBench> b(producers);
+	vector<pthread_t> tid(producers);
+	double start = now_sec();
+	for (unsigned p = 0; p < producers; p++) {
+		b[p].topo = &topo;
+		b[p].numa = numa;
+		b[p].global = global;
+		b[p].global_lock = &lock;
+		b[p].id = p;
+		b[p].ops = ops;
+		b[p].weight = (skew && p % topo.nodes() == 0) ? 3 : 1;
+		pthread_create(&tid[p], NULL, numa_producer, &b[p]);
+	}
+	for (unsigned p = 0; p < producers; p++)
+		pthread_join(tid[p], NULL);
+	double elapsed = now_sec() - start;
+	pthread_mutex_destroy(&lock);
+	return elapsed;
+}
+
+static int bench_numa(unsigned nodes, unsigned producers) {
+	const unsigned throughput = 100000, ops = 50000;
+	NumaTopology topo;
+	if (nodes == 0 && topo.load() > 1) {
+		nodes = topo.nodes();
+		cout << "using " << nodes << " numa nodes" << endl;
+	} else {
+		if (nodes == 0)
+			nodes = 2;
+		topo.simulate(nodes);
+		cout << "simulating " << nodes << " numa nodes" << endl;
+	}
+
+	PrioritizedQueueDMClock<unsigned, unsigned> global(throughput, 10);
+	global.set_mClock_trace(false);
+	double t = run_numa_producers(topo, NULL, &global, producers, ops, false);
+	cout << producers << " producers, one scheduler: "
+			<< producers * ops / t / 1e6 << " Mops/s" << endl;
+
+	NumaDMClock<unsigned, unsigned> numa(topo, throughput, 10);
+	t = run_numa_producers(topo, &numa, NULL, producers, ops, false);
+	cout << producers << " producers, per-node shards: "
+			<< producers * ops / t / 1e6 << " Mops/s" << endl;
+
+	// node 0 sees three times the demand of the others
+	NumaDMClock<unsigned, unsigned> skewed(topo, throughput, 10);
+	run_numa_producers(topo, &skewed, NULL, producers, ops / 10, true);
+	skewed.balance();
+	cout << "throughput after balance with node 0 at 3x demand:";
+	for (unsigned n = 0; n < skewed.nodes(); n++)
+		cout << " " << skewed.get_throughput(n);
+	cout << endl;
+	return 0;
+}
+
+// every client is placed on node 0 and each node's worker dispatches
+// one op per device slot, from its own shard or, when that is empty,
+// by stealing. reports slots to drain and device utilization.
+static void run_steal(unsigned nodes, bool steal) {
+	const unsigned clients = 64, depth = 200;
+	NumaTopology topo;
+	topo.simulate(nodes);
+	NumaDMClock<unsigned, unsigned> q(topo, 100000, 10);
+	SLO slo;
+	slo.prop = 10;
+	slo.limit = 0;
+	for (unsigned c = 0; c < clients; c++) {
+		slo.reserve = c < 8 ? 1000 : 0; // a few reserved tenants
+		q.bind_client(c, 0);
+		for (unsigned j = 0; j < depth; j++)
+			q.enqueue_mClock(c, slo, 0, c);
+	}
+	unsigned left = clients * depth, slots = 0, busy = 0, stolen = 0;
+	while (left) {
+		slots++;
+		for (unsigned n = 0; n < nodes; n++) {
+			unsigned v;
+			if (q.dequeue_mClock(n, &v) == 0) {
+				busy++;
+				left--;
+			} else if (steal && q.steal_mClock(n, &v) == 0) {
+				busy++;
+				stolen++;
+				left--;
+			}
+		}
+	}
+	cout << (steal ? "stealing:    " : "no stealing: ") << slots
+			<< " slots, utilization " << 100.0 * busy / (slots * nodes)
+			<< "%, stolen " << stolen << endl;
+}
+
+static int bench_steal(unsigned nodes) {
+	cout << nodes << " workers, all clients on node 0" << endl;
+	run_steal(nodes, false);
+	run_steal(nodes, true);
+	return 0;
+}
+
+// producers enqueue through the staging ring or through one lock,
+// then the consumer drains everything
+struct IntakeBench {
+	PrioritizedQueueDMClock<unsigned, unsigned> *q;
+	pthread_mutex_t *lock;
+	unsigned id, ops;
+};
+
+static void *intake_producer(void *arg) {
+	IntakeBench *b = (IntakeBench *) arg;
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 10;
+	slo.limit = 0;
+	for (unsigned i = 0; i < b->ops; i++) {
+		unsigned cl = b->id * 8 + i % 8;
+		if (b->lock) {
+			pthread_mutex_lock(b->lock);
+			b->q->enqueue_mClock(cl, slo, 0, i);
+			pthread_mutex_unlock(b->lock);
+		} else {
+			while (b->q->stage_mClock(cl, slo, 0, i) == -EAGAIN)
+				sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static void run_intake(unsigned producers, unsigned ops, bool ring) {
+	PrioritizedQueueDMClock<unsigned, unsigned> q(100000, 10);
+	q.set_mClock_trace(false);
+	if (ring)
+		q.set_mClock_intake(producers * ops);
+	pthread_mutex_t lock;
+	pthread_mutex_init(&lock, NULL);
+	vector<IntakeBench> b(producers);
+	vector<pthread_t> tid(producers);
+	double start = now_sec();
+	for (unsigned p = 0; p < producers; p++) {
+		b[p].q = &q;
+		b[p].lock = ring ? NULL : &lock;
+		b[p].id = p;
+		b[p].ops = ops;
+		pthread_create(&tid[p], NULL, intake_producer, &b[p]);
+	}
+	for (unsigned p = 0; p < producers; p++)
+		pthread_join(tid[p], NULL);
+	double elapsed = now_sec() - start;
+	unsigned n = 0;
+	while (!q.empty()) {
+		q.dequeue_mClock();
+		n++;
+	}
+	assert(n == producers * ops);
+	pthread_mutex_destroy(&lock);
+	cout << (ring ? "staging ring: " : "locked:       ")
+			<< producers * ops / elapsed / 1e6 << " M enqueues/s" << endl;
+}
+
+static int bench_intake(unsigned producers) {
+	const unsigned ops = 200000;
+	cout << producers << " producers" << endl;
+	run_intake(producers, ops, false);
+	run_intake(producers, ops, true);
+	return 0;
+}
+
+// reservation-only clients on a device with spare capacity: every
+// slot the scheduler cannot fill is lost unless it is work conserving
+static void run_idle_spare(bool wc) {
+	const unsigned slots = 3000;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(1000, 10);
+	q.set_mClock_trace(false);
+	q.set_mClock_work_conserving(wc);
+	SLO slo;
+	slo.prop = 0;
+	slo.limit = 0;
+	for (unsigned c = 0; c < 3; c++) {
+		slo.reserve = 100 * (c + 1);
+		for (unsigned j = 0; j < slots; j++)
+			q.enqueue_mClock(c, slo, 0, c);
+	}
+	unsigned ops[3] = { 0, 0, 0 };
+	for (unsigned s = 0; s < slots; s++) {
+		unsigned v;
+		if (q.try_dequeue_mClock(&v) == 0)
+			ops[v]++;
+	}
+	cout << (wc ? "work conserving: " : "default:         ") << "utilization "
+			<< 100.0 * (ops[0] + ops[1] + ops[2]) / slots << "%, ops " << ops[0]
+			<< "/" << ops[1] << "/" << ops[2] << endl;
+}
+
+// client 0 has a reservation and issues one request at a time, the
+// next one think slots after the last completes. client 1 is a
+// backlogged proportional client. switching between clients costs the
+// device seek extra slots, so idling briefly for client 0 can beat
+// giving the slot away. returns the number of switches.
+static unsigned simulate_dependent(int64_t reserve, int64_t window,
+		unsigned slots, unsigned ops[2]) {
+	const unsigned seek = 4, think = 1;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(1000, 10);
+	q.set_mClock_trace(false);
+	q.set_mClock_work_conserving(true, window);
+	SLO s0, s1;
+	s0.reserve = reserve;
+	s0.prop = 0;
+	s0.limit = 0;
+	s1.reserve = 0;
+	s1.prop = 10;
+	s1.limit = 0;
+	for (unsigned j = 0; j < slots; j++)
+		q.enqueue_mClock(1, s1, 0, 1);
+	unsigned switches = 0, busy_until = 0, arrive = 0;
+	ops[0] = ops[1] = 0;
+	bool outstanding = false;
+	int prev = -1;
+	for (unsigned s = 0; s < slots; s++) {
+		if (!outstanding && s >= arrive) {
+			q.enqueue_mClock(0, s0, 0, 0);
+			outstanding = true;
+		}
+		if (s < busy_until)
+			continue;
+		unsigned v;
+		if (q.try_dequeue_mClock(&v) != 0)
+			continue;
+		unsigned cost = 1;
+		if (prev >= 0 && (unsigned) prev != v) {
+			cost += seek;
+			switches++;
+		}
+		prev = v;
+		busy_until = s + cost;
+		ops[v]++;
+		if (v == 0) {
+			outstanding = false;
+			arrive = busy_until + think;
+		}
+	}
+	return switches;
+}
+
+static void run_idle_anticipate(int64_t reserve, int64_t window) {
+	unsigned ops[2];
+	unsigned switches = simulate_dependent(reserve, window, 20000, ops);
+	cout << "reserve " << reserve << ", anticipation " << window << ": ops "
+			<< ops[0] << "/" << ops[1]
+			<< ", total " << ops[0] + ops[1] << ", switches " << switches
+			<< endl;
+}
+
+static int bench_idle() {
+	cout << "3 reservation-only clients (100/200/300 of 1000)" << endl;
+	run_idle_spare(false);
+	run_idle_spare(true);
+	cout << "dependent reserved client vs backlogged client, seek cost 4"
+			<< endl;
+	run_idle_anticipate(400, 0);
+	run_idle_anticipate(400, 3);
+	run_idle_anticipate(500, 0);
+	run_idle_anticipate(500, 3);
+	return 0;
+}
+
+static double bench_read(int source) {
+	const unsigned reads = 2000000;
+	uint64_t sum = 0;
+	double start = now_sec();
+	for (unsigned i = 0; i < reads; i++)
+		sum += ceph_clock_read_ns(source);
+	double elapsed = now_sec() - start;
+	assert(sum);
+	return elapsed * 1e9 / reads;
+}
+
+// ns per dequeue from the time-refilled weighted queues, which read
+// the clock once per pass
+static double bench_refill(int source) {
+	const unsigned ops = 500000;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(1000, 10);
+	q.set_clock_source(source);
+	q.set_token_refill_rate(1e9);
+	for (unsigned i = 0; i < ops; i++)
+		q.enqueue(i % 16, 1 + i % 8, 10, i);
+	double start = now_sec();
+	while (!q.empty())
+		q.dequeue();
+	return (now_sec() - start) * 1e9 / ops;
+}
+
+static int bench_clock() {
+	const char *names[] = { "realtime", "monotonic", "monotonic coarse",
+			"tsc" };
+	cout << "tsc " << (ceph_tsc_clock().is_usable() ? "invariant" :
+			"not usable, falls back to monotonic") << endl;
+	for (int s = CEPH_CLOCK_REALTIME; s <= CEPH_CLOCK_TSC; s++)
+		cout << setw(17) << left << names[s] << right << fixed
+				<< setprecision(1) << bench_read(s) << " ns/read, "
+				<< bench_refill(s) << " ns/dequeue" << endl;
+	// error against monotonic across a few resyncs
+	int64_t worst = 0;
+	double end = now_sec() + 3;
+	while (now_sec() < end) {
+		uint64_t m0 = ceph_clock_read_ns(CEPH_CLOCK_MONOTONIC);
+		uint64_t t = ceph_clock_read_ns(CEPH_CLOCK_TSC);
+		uint64_t m1 = ceph_clock_read_ns(CEPH_CLOCK_MONOTONIC);
+		int64_t err = 0;
+		if (t < m0)
+			err = m0 - t;
+		else if (t > m1)
+			err = t - m1;
+		if (err > worst)
+			worst = err;
+		usleep(1000);
+	}
+	cout << "tsc max error vs monotonic over 3s: " << worst << " ns" << endl;
+	return 0;
+}
+
+// trace timestamps: libc formatting and parsing against the utime_t
+// fast paths, over a run of times a few microseconds apart
+static int bench_utime() {
+	const unsigned n = 1000000;
+	utime_t base(1435226400, 0);
+	char buf[64];
+	size_t sum = 0;
+	double start = now_sec();
+	for (unsigned i = 0; i < n; i++) {
+		utime_t t = base + utime_t(0, i * 3000);
+		struct tm bdt;
+		time_t tt = t.sec();
+		localtime_r(&tt, &bdt);
+		sum += snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d.%06ld",
+				bdt.tm_year + 1900, bdt.tm_mon + 1, bdt.tm_mday, bdt.tm_hour,
+				bdt.tm_min, bdt.tm_sec, t.usec());
+	}
+	double libc_fmt = (now_sec() - start) * 1e9 / n;
+	start = now_sec();
+	for (unsigned i = 0; i < n; i++)
+		sum += (base + utime_t(0, i * 3000)).localtime(buf, sizeof(buf));
+	double fast_fmt = (now_sec() - start) * 1e9 / n;
+
+	const char *date = "2015-06-25 10:11:12.123456";
+	uint64_t epoch = 0, nsec = 0;
+	start = now_sec();
+	for (unsigned i = 0; i < n; i++) {
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		const char *p = strptime(date, "%Y-%m-%d %H:%M:%S", &tm);
+		sum += timegm(&tm) + (p ? strtol(p + 1, NULL, 10) : 0);
+	}
+	double libc_parse = (now_sec() - start) * 1e9 / n;
+	start = now_sec();
+	for (unsigned i = 0; i < n; i++) {
+		utime_t::parse_iso8601(date, &epoch, &nsec);
+		sum += epoch + nsec;
+	}
+	double fast_parse = (now_sec() - start) * 1e9 / n;
+	assert(sum);
+
+	cout << fixed << setprecision(1) << "format: libc " << libc_fmt
+			<< " ns, utime_t " << fast_fmt << " ns" << endl;
+	cout << "parse:  libc " << libc_parse << " ns, utime_t " << fast_parse
+			<< " ns" << endl;
+	return 0;
+}
+
+// two backlogged classes at one priority, one sending ops ten times
+// the cost of the other's
+static void run_drr_share(bool drr) {
+	PrioritizedQueueDMClock<unsigned, unsigned> q(1000, 10);
+	q.set_deficit_round_robin(drr);
+	for (unsigned i = 0; i < 2000; i++) {
+		q.enqueue(0, 10, 800, 0);
+		for (unsigned k = 0; k < 10; k++)
+			q.enqueue(1, 10, 80, 1);
+	}
+	uint64_t cost[2] = { 0, 0 };
+	for (unsigned i = 0; i < 4000; i++) {
+		unsigned v = q.dequeue();
+		cost[v] += v ? 80 : 800;
+	}
+	cout << (drr ? "deficit round robin: " : "round robin:         ")
+			<< "cost share " << fixed << setprecision(1)
+			<< 100.0 * cost[0] / (cost[0] + cost[1]) << "% / "
+			<< 100.0 * cost[1] / (cost[0] + cost[1]) << "%" << endl;
+}
+
+// ns per dequeue with many classes queued at one priority
+static double run_drr_classes(bool drr, unsigned classes) {
+	const unsigned ops = 1000000;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(1000, 10);
+	q.set_deficit_round_robin(drr);
+	for (unsigned i = 0; i < ops; i++)
+		q.enqueue(i % classes, 10, 10 + i % 7 * 100, i);
+	double start = now_sec();
+	while (!q.empty())
+		q.dequeue();
+	return (now_sec() - start) * 1e9 / ops;
+}
+
+static int bench_drr(unsigned classes) {
+	run_drr_share(false);
+	run_drr_share(true);
+	cout << classes << " classes: round robin " << run_drr_classes(false,
+			classes) << " ns/dequeue, deficit round robin "
+			<< run_drr_classes(true, classes) << " ns/dequeue" << endl;
+	return 0;
+}
+
+// time to register clients proportional clients one by one, then to
+// retire a tenth of them and register as many new ones, ten times.
+// the dequeues that let clients go idle are not counted.
+static void run_join(unsigned clients) {
+	PrioritizedQueueDMClock<unsigned, unsigned> q(100000, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.limit = 0;
+	double start = now_sec();
+	for (unsigned c = 0; c < clients; c++) {
+		slo.prop = 1 + c % 10;
+		q.enqueue_mClock(c, slo, 0, c);
+	}
+	double join = now_sec() - start, churn = 0;
+	for (unsigned round = 0; round < 10; round++) {
+		for (unsigned i = 0; i < clients / 10; i++)
+			q.dequeue_mClock();
+		start = now_sec();
+		q.purge_mClock();
+		for (unsigned i = 0; i < clients / 10; i++) {
+			unsigned c = clients * (round + 1) + i;
+			slo.prop = 1 + c % 10;
+			q.enqueue_mClock(c, slo, 0, c);
+		}
+		churn += now_sec() - start;
+	}
+	cout << clients << " clients: join " << join * 1e3 << " ms, churn "
+			<< churn * 1e3 << " ms" << endl;
+}
+
+static int bench_join() {
+	run_join(5000);
+	run_join(10000);
+	run_join(20000);
+	return 0;
+}
+
+// ns per enqueue + dequeue for clients named by long string keys,
+// passing the key every time or the id interned for it once
+static double run_intern(bool by_id, unsigned clients) {
+	const unsigned ops = 1000000;
+	PrioritizedQueueDMClock<unsigned, string> q(100000, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	vector<string> keys;
+	vector<PrioritizedQueueDMClock<unsigned, string>::ClientId> ids;
+	for (unsigned c = 0; c < clients; c++) {
+		char buf[64];
+		snprintf(buf, sizeof(buf), "client.rbd.pool.volume-%08u", c);
+		keys.push_back(buf);
+		ids.push_back(q.intern_client(keys.back()));
+	}
+	double start = now_sec();
+	for (unsigned i = 0; i < ops; i++) {
+		if (by_id)
+			q.enqueue_mClock(ids[i % clients], slo, 0, i);
+		else
+			q.enqueue_mClock(keys[i % clients], slo, 0, i);
+		if (q.mClock_length() > clients)
+			q.dequeue_mClock();
+	}
+	return (now_sec() - start) * 1e9 / ops;
+}
+
+static int bench_intern(unsigned clients) {
+	cout << clients << " clients: by key " << run_intern(false, clients)
+			<< " ns/op, by id " << run_intern(true, clients) << " ns/op"
+			<< endl;
+	return 0;
+}
+
+// three devices of different speeds behind one queue. four tenants
+// hold a different proportional share on each; a worker per device
+// pulls only that device's work and we count whose it was.
+static int bench_devices() {
+	const char *names[] = { "nvme", "hdd", "journal" };
+	const unsigned throughput[] = { 10000, 200, 2000 };
+	const unsigned tenants = 4, ops = 20000;
+	PrioritizedQueueDMClock<unsigned, string> q(throughput[0], 10);
+	q.set_mClock_trace(false);
+	q.add_mClock_device(throughput[1]);
+	q.add_mClock_device(throughput[2]);
+	PrioritizedQueueDMClock<unsigned, string>::ClientId ids[tenants];
+	for (unsigned t = 0; t < tenants; t++) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "tenant.%u", t);
+		ids[t] = q.intern_client(buf);
+		for (unsigned d = 0; d < 3; d++) {
+			SLO slo;
+			slo.reserve = 0;
+			slo.prop = d == 1 ? tenants - t : t + 1;
+			slo.limit = 0;
+			q.set_mClock_slo(ids[t], d, slo);
+		}
+	}
+	for (unsigned d = 0; d < 3; d++) {
+		for (unsigned i = 0; i < ops; i++)
+			q.enqueue_mClock(ids[i % tenants], d, 0, i % tenants);
+		unsigned served[tenants] = { 0 };
+		double start = now_sec();
+		for (unsigned i = 0; i < ops / 2; i++)
+			served[q.dequeue_mClock(d)]++;
+		double ns = (now_sec() - start) * 1e9 / (ops / 2);
+		cout << names[d] << ":";
+		for (unsigned t = 0; t < tenants; t++)
+			cout << " " << served[t];
+		cout << "  (" << ns << " ns/dequeue)" << endl;
+	}
+	return 0;
+}
+
+// a simulated device, in 1us steps: four ops in service at a time,
+// 50-150us each, behind a FIFO with no limit. a bulk tenant keeps 64 ops
+// outstanding; a latency sensitive one sends an op every 1ms. we
+// report the latter's end to end latency with no dispatch window, a
+// fixed one and an adaptive one aiming at 250us in the device.
+static void run_window(const char *name, unsigned limit, uint64_t target) {
+	const unsigned slots = 4, service = 100, bulk_depth = 64;
+	const uint64_t steps = 2000000;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(slots * 1000000 / service,
+			10);
+	q.set_mClock_trace(false);
+	if (target)
+		q.set_mClock_adaptive_window(target, 1, 64);
+	else
+		q.set_mClock_window(limit);
+	SLO bulk, small;
+	bulk.reserve = 0;
+	bulk.prop = 1;
+	bulk.limit = 0;
+	small.reserve = 1000;
+	small.prop = 1;
+	small.limit = 0;
+
+	vector<uint64_t> queued, sent; // per op
+	vector<unsigned> owner;
+	std::deque<unsigned> fifo; // the device's queue
+	std::vector<std::pair<uint64_t, unsigned> > busy; // (done at, op)
+	vector<uint64_t> lat;
+	unsigned outstanding = 0;
+	uint64_t done = 0, window_sum = 0;
+	srand(1);
+	for (uint64_t t = 0; t < steps; t++) {
+		while (outstanding < bulk_depth) {
+			q.enqueue_mClock(0u, bulk, 0, queued.size());
+			queued.push_back(t);
+			sent.push_back(0);
+			owner.push_back(0);
+			outstanding++;
+		}
+		if (t % 1000 == 0) {
+			q.enqueue_mClock(1u, small, 0, queued.size());
+			queued.push_back(t);
+			sent.push_back(0);
+			owner.push_back(1);
+		}
+		for (size_t i = 0; i < busy.size();) {
+			if (busy[i].first > t) {
+				i++;
+				continue;
+			}
+			unsigned op = busy[i].second;
+			q.mClock_completed(t - sent[op]);
+			if (owner[op])
+				lat.push_back(t - queued[op]);
+			else
+				outstanding--;
+			done++;
+			busy[i] = busy.back();
+			busy.pop_back();
+		}
+		unsigned op;
+		while (q.mClock_length() && q.try_dequeue_mClock(&op) == 0) {
+			sent[op] = t;
+			fifo.push_back(op);
+		}
+		while (busy.size() < slots && !fifo.empty()) {
+			busy.push_back(std::make_pair(t + service / 2 + rand() % service,
+					fifo.front()));
+			fifo.pop_front();
+		}
+		window_sum += q.get_mClock_window();
+	}
+	std::sort(lat.begin(), lat.end());
+	cout << name << ": p50 " << lat[lat.size() / 2] << "us p99 "
+			<< lat[lat.size() * 99 / 100] << "us, " << done * 1000000 / steps
+			<< " ops/s";
+	if (target)
+		cout << ", mean window " << (double) window_sum / steps;
+	cout << endl;
+}
+
+static int bench_window() {
+	run_window("no window", 0, 0);
+	run_window("window 8", 8, 0);
+	run_window("adaptive 250us", 0, 250);
+	return 0;
+}
+
+struct WriteOp {
+	unsigned client;
+	uint64_t off;
+	unsigned len;
+};
+
+typedef PrioritizedQueueDMClock<WriteOp, unsigned> WriteQueue;
+
+// writes that pick up where the last one ended, up to 128k
+struct SequentialMerge: public WriteQueue::MergeHook {
+	bool can_merge(const WriteOp &merged, const WriteOp &next) {
+		return merged.off + merged.len == next.off
+				&& merged.len + next.len <= 131072;
+	}
+	void merge(WriteOp &merged, const WriteOp &next) {
+		merged.len += next.len;
+	}
+};
+
+// client 0 streams sequential 4k writes, client 1 random ones, both
+// with the same share. we count requests served per client and the
+// ops the device would see.
+static void run_merge(unsigned max_ops) {
+	const unsigned ops = 400000;
+	WriteQueue q(100000, 10);
+	q.set_mClock_trace(false);
+	SequentialMerge hook;
+	q.set_mClock_merge(&hook, max_ops);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	uint64_t seq = 0;
+	for (unsigned i = 0; i < ops; i++) {
+		WriteOp op;
+		op.client = i % 2;
+		op.len = 4096;
+		if (op.client == 0) {
+			op.off = seq;
+			seq += op.len;
+		} else
+			op.off = (uint64_t) (rand() % 100000) * 4096;
+		q.enqueue_mClock(op.client, slo, op.len, op);
+	}
+	uint64_t served[2] = { 0, 0 }, device_ops = 0;
+	double start = now_sec();
+	while (served[0] + served[1] < ops / 2) {
+		WriteOp op = q.dequeue_mClock();
+		served[op.client] += op.len / 4096;
+		device_ops++;
+	}
+	double ns = (now_sec() - start) * 1e9 / (served[0] + served[1]);
+	cout << "merge " << max_ops << ": served " << served[0] << " / "
+			<< served[1] << " requests in " << device_ops << " device ops, "
+			<< ns << " ns/request" << endl;
+}
+
+static int bench_merge() {
+	run_merge(1);
+	run_merge(8);
+	run_merge(32);
+	return 0;
+}
+
+// two clients with equal shares, all backlogged. a third of client
+// 0's ops hit a locked object once and go back with requeue_mClock().
+// we count the ops each client actually completes, with and without
+// the refund of the retried dispatch.
+static void run_requeue(bool refund) {
+	const unsigned ops = 300000;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(100000, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned i = 0; i < ops; i++)
+		q.enqueue_mClock(i % 2, slo, 0, i);
+	vector<bool> retried(ops);
+	unsigned done[2] = { 0, 0 };
+	while (done[0] + done[1] < ops / 2) {
+		PrioritizedQueueDMClock<unsigned, unsigned>::Charge charge;
+		unsigned op = q.dequeue_mClock(0, &charge);
+		if (op % 6 == 0 && !retried[op]) {
+			retried[op] = true;
+			q.requeue_mClock(0u, slo, 0, op, refund ? &charge : NULL);
+			continue;
+		}
+		done[op % 2]++;
+	}
+	cout << (refund ? "refund" : "no refund") << ": completed " << done[0]
+			<< " / " << done[1] << endl;
+}
+
+static int bench_requeue() {
+	run_requeue(false);
+	run_requeue(true);
+	return 0;
+}
+
+// a few busy clients among many idle ones, then every client coming
+// and going in turn. ns per enqueue + dequeue; the idle clients should
+// cost the busy ones nothing.
+static void run_cold(unsigned clients) {
+	const unsigned ops = 1000000, busy = 64;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(100000, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned c = 0; c < clients; c++) {
+		q.enqueue_mClock(c, slo, 0, c);
+		q.dequeue_mClock();
+	}
+	double start = now_sec();
+	for (unsigned i = 0; i < ops; i++) {
+		q.enqueue_mClock(i % busy, slo, 0, i);
+		if (q.mClock_length() > busy)
+			q.dequeue_mClock();
+	}
+	double steady = now_sec() - start;
+	while (q.mClock_length())
+		q.dequeue_mClock();
+	start = now_sec();
+	for (unsigned i = 0; i < ops; i++) {
+		q.enqueue_mClock((i * 7919u) % clients, slo, 0, i);
+		if (q.mClock_length() > busy)
+			q.dequeue_mClock();
+	}
+	double churn = now_sec() - start;
+	cout << clients << " clients: busy " << steady * 1e9 / ops
+			<< " ns/op, churn " << churn * 1e9 / ops << " ns/op" << endl;
+}
+
+static int bench_cold() {
+	run_cold(1000);
+	run_cold(100000);
+	run_cold(1000000);
+	return 0;
+}
+
+static bool same_file(const char *x, const char *y) {
+	FILE *a = fopen(x, "r"), *b = fopen(y, "r");
+	assert(a && b);
+	int ca, cb;
+	do {
+		ca = fgetc(a);
+		cb = fgetc(b);
+	} while (ca == cb && ca != EOF);
+	fclose(a);
+	fclose(b);
+	return ca == cb;
+}
+
+// every client survives a checkpoint and restore, and is served by
+// its restored SLO. a fresh queue's clock starts at 0, so deadlines
+// further back than that are clamped on the first restore; after it
+// a round trip gives back the same bytes.
+static void test_checkpoint() {
+	const char *path = "/tmp/PriorityQueueTest.ckpt";
+	const char *again = "/tmp/PriorityQueueTest.ckpt.2";
+	const char *third = "/tmp/PriorityQueueTest.ckpt.3";
+	PrioritizedQueueDMClock<unsigned, unsigned> q(1000, 10);
+	q.set_mClock_trace(false);
+	for (unsigned i = 0; i < 2000; i++) {
+		unsigned c = i % 100;
+		SLO slo;
+		slo.reserve = c % 2 ? 10 : 0;
+		slo.prop = 1 + c % 3;
+		slo.limit = c % 5 ? 0 : 500;
+		q.enqueue_mClock(c, slo, 0, c);
+	}
+	SLO one, three;
+	one.reserve = three.reserve = 0;
+	one.prop = 1;
+	three.prop = 3;
+	one.limit = three.limit = 0;
+	q.enqueue_mClock(1000u, one, 0, 1000);
+	q.enqueue_mClock(1001u, three, 0, 1001);
+	while (!q.empty())
+		q.dequeue_mClock();
+	assert(q.checkpoint_mClock(path) == 0);
+
+	PrioritizedQueueDMClock<unsigned, unsigned> r(1000, 10);
+	r.set_mClock_trace(false);
+	assert(r.restore_mClock("/tmp/PriorityQueueTest.none") == -ENOENT);
+	assert(r.restore_mClock(path) == 0);
+	assert(r.restore_mClock(path) == -EBUSY);
+	assert(r.checkpoint_mClock(again) == 0);
+	struct stat sa, sb;
+	assert(stat(path, &sa) == 0 && stat(again, &sb) == 0);
+	assert(sa.st_size == sb.st_size);
+
+	PrioritizedQueueDMClock<unsigned, unsigned> t(1000, 10);
+	t.set_mClock_trace(false);
+	assert(t.restore_mClock(again) == 0);
+	assert(t.checkpoint_mClock(third) == 0);
+	assert(same_file(again, third));
+
+	// a cut short file is refused
+	assert(truncate(third, 200) == 0);
+	PrioritizedQueueDMClock<unsigned, unsigned> u(1000, 10);
+	assert(u.restore_mClock(third) == -EINVAL);
+	// so is one from an older version, whose records were laid out
+	// differently; the version follows the magic
+	FILE *fp = fopen(again, "r+");
+	uint32_t v2 = 2;
+	assert(fp && fseek(fp, 4, SEEK_SET) == 0 && fwrite(&v2, 4, 1, fp) == 1);
+	fclose(fp);
+	assert(u.restore_mClock(again) == -EINVAL);
+	unlink(path);
+	unlink(again);
+	unlink(third);
+
+	// the SLOs passed here are ignored: restored tags keep theirs
+	unsigned n[2] = { 0, 0 };
+	for (unsigned i = 0; i < 400; i++) {
+		r.enqueue_mClock(1000u, one, 0, 0);
+		r.enqueue_mClock(1001u, one, 0, 1);
+	}
+	for (unsigned i = 0; i < 400; i++)
+		n[r.dequeue_mClock()]++;
+	assert(n[0] > 90 && n[0] < 110);
+}
+
+// what the tests need to see of the dmClock queue's insides
+struct DMClockTestAccess {
+	template<class Q>
+	static size_t eligible(Q &q, unsigned device = 0) {
+		return q.dm_queues[device].eligible.count;
+	}
+
+	template<class Q>
+	static int64_t &virtual_clock(Q &q, unsigned device = 0) {
+		return q.dm_queues[device].virtual_clock;
+	}
+
+	template<class Q>
+	static int64_t epoch_limit() {
+		return Q::SubQueueDMClock::epoch_limit();
+	}
+
+	template<class Q>
+	struct SubQueue: public Q::SubQueue {
+	};
+
+	// do the priority bitmaps match the classes they index?
+	template<class Q, class S>
+	static bool masks_match(const S &table) {
+		for (unsigned p = 0; p < Q::MAX_PRIORITIES; p++) {
+			const typename Q::SubQueue &sq = table[p];
+			bool nonempty = !sq.empty();
+			bool eligible = nonempty && sq.front().first < sq.num_tokens();
+			if (table.has(p) != nonempty
+					|| bool(table.eligible & S::bit(p)) != eligible)
+				return false;
+		}
+		return true;
+	}
+
+	// the queue's token refill clock, to set() once its source is
+	// CEPH_CLOCK_MANUAL
+	template<class Q>
+	static CachedClock &clock(Q &q) {
+		return q.clock;
+	}
+
+	template<class Q>
+	static bool masks_match(const Q &q) {
+		return masks_match<Q>(q.queue) && masks_match<Q>(q.high_queue);
+	}
+
+	template<class Q>
+	static int64_t total_priority(const Q &q) {
+		return q.total_priority;
+	}
+
+	// where n advances of a rate spaced tag clock started at 0 land
+	template<class Q>
+	static int64_t advanced(uint64_t throughput, uint64_t rate, unsigned n) {
+		typename Q::SubQueueDMClock::TagClock c;
+		c.spacing = Q::SubQueueDMClock::make_spacing(throughput, rate);
+		Q::SubQueueDMClock::advance(c, n);
+		return c.deadline;
+	}
+
+	// deadline and carry of a hot client's reservation, proportional
+	// and limit tags on device, then its SLO
+	template<class Q>
+	static vector<int64_t> tags(Q &q, typename Q::ClientId id,
+			unsigned device = 0) {
+		typename Q::SubQueueDMClock &dq = q.dm_queues[device];
+		assert(dq.requests[id.id].cl_index != Q::SubQueueDMClock::NIL);
+		typename Q::SubQueueDMClock::Tag &t =
+				dq.schedule[dq.requests[id.id].cl_index];
+		vector<int64_t> v;
+		v.push_back(t.r().deadline);
+		v.push_back(t.r().carry);
+		v.push_back(t.p().deadline);
+		v.push_back(t.p().carry);
+		v.push_back(t.l().deadline);
+		v.push_back(t.l().carry);
+		v.push_back(t.slo.reserve);
+		v.push_back(t.slo.prop);
+		v.push_back(t.slo.limit);
+		return v;
+	}
+
+	// is id's reservation due on the device's clock?
+	template<class Q>
+	static bool reserve_due(Q &q, typename Q::ClientId id,
+			unsigned device = 0) {
+		typedef typename Q::SubQueueDMClock S;
+		S &dq = q.dm_queues[device];
+		assert(dq.requests[id.id].cl_index != S::NIL);
+		return dq.schedule[dq.requests[id.id].cl_index].r().deadline
+				<= dq.get_current_tag();
+	}
+
+	// the same, for a client in cold storage
+	template<class Q>
+	static vector<int64_t> cold_tags(Q &q, typename Q::ClientId id,
+			unsigned device = 0) {
+		typedef typename Q::SubQueueDMClock S;
+		S &dq = q.dm_queues[device];
+		assert(dq.requests[id.id].cold != S::NIL);
+		const typename S::ColdTag &ct = dq.cold[dq.requests[id.id].cold];
+		vector<int64_t> v;
+		v.push_back(ct.deadline[S::R_SLOT]);
+		v.push_back(ct.carry[S::R_SLOT]);
+		v.push_back(ct.deadline[S::P_SLOT]);
+		v.push_back(ct.carry[S::P_SLOT]);
+		v.push_back(ct.deadline[S::L_SLOT]);
+		v.push_back(ct.carry[S::L_SLOT]);
+		v.push_back(ct.slo.reserve);
+		v.push_back(ct.slo.prop);
+		v.push_back(ct.slo.limit);
+		return v;
+	}
+
+	// bring a cold client's tag back into the schedule, still idle,
+	// as its next enqueue would
+	template<class Q>
+	static void promote(Q &q, typename Q::ClientId id, unsigned device = 0) {
+		typename Q::SubQueueDMClock &dq = q.dm_queues[device];
+		dq.promote(dq.requests[id.id].cold);
+	}
+
+	// clients with a slot in the schedule selection scans
+	template<class Q>
+	static size_t hot(Q &q, unsigned device = 0) {
+		typename Q::SubQueueDMClock &dq = q.dm_queues[device];
+		return dq.schedule.size() - dq.free_slots.size();
+	}
+};
+
+struct Forgotten: public PrioritizedQueueDMClock<unsigned, unsigned>::ClientListener {
+	vector<unsigned> keys;
+	void forget(const unsigned &cl) {
+		keys.push_back(cl);
+	}
+};
+
+// idle clients are reclaimed once idle for ttl dispatches, at most a
+// batch per enqueue or dequeue, oldest first, and never a busy one
+static void test_reclaim() {
+	const unsigned clients = 200, ttl = 50, batch = 4;
+	PrioritizedQueueDMClock<unsigned, unsigned> q(1000, 10);
+	q.set_mClock_trace(false);
+	Forgotten f;
+	q.set_client_listener(&f);
+	q.set_mClock_idle_ttl(ttl, batch);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned c = 1; c <= clients; c++) {
+		q.enqueue_mClock(c, slo, 0, c);
+		q.dequeue_mClock();
+	}
+	size_t seen = f.keys.size();
+	assert(seen <= clients - ttl + 1);
+	while (f.keys.size() < clients) {
+		q.enqueue_mClock(0u, slo, 0, 0);
+		q.dequeue_mClock();
+		assert(f.keys.size() - seen <= 2 * batch);
+		seen = f.keys.size();
+	}
+	for (unsigned i = 0; i < clients; i++)
+		assert(f.keys[i] == i + 1);
+	assert(q.client_length(0u) == 0);
+
+	// a reclaimed client comes back as a new one
+	q.enqueue_mClock(7u, slo, 0, 7);
+	assert(q.client_length(7u) == 1);
+	assert(q.dequeue_mClock() == 7);
+
+	// purging takes every idle client at once
+	q.purge_mClock();
+	assert(f.keys.size() == clients + 2);
+	assert(q.empty());
+}
+
+// limit-throttled clients sit in the timing wheel, at every level.
+// their shares would take far more than their limits, so each must
+// be served at exactly its limit: never ahead of it, and with no
+// wakeup lost in the wheel. meanwhile the eligible list selection
+// walks holds only the clients that are due. their phases line up,
+// so now and then many are due at once, but on average it is a small
+// fraction of them.
+static void test_wheel() {
+	const unsigned throughput = 20000, ops = 40000, clients = 100;
+	const unsigned limits[] = { 2, 5, 50, 500 };
+	PrioritizedQueueDMClock<unsigned, unsigned> q(throughput, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned i = 0; i < ops; i++)
+		q.enqueue_mClock(0u, slo, 0, 0);
+	slo.prop = 1000;
+	for (unsigned c = 1; c <= clients; c++) {
+		slo.limit = limits[c % 4];
+		for (unsigned i = 0; i <= ops / (throughput / slo.limit); i++)
+			q.enqueue_mClock(c, slo, 0, c);
+	}
+	vector<unsigned> served(clients + 1);
+	uint64_t eligible = 0;
+	for (unsigned i = 0; i < ops; i++) {
+		unsigned c = q.dequeue_mClock();
+		if (c) {
+			unsigned spacing = throughput / limits[c % 4];
+			assert(served[c]++ <= i / spacing);
+		}
+		eligible += DMClockTestAccess::eligible(q);
+	}
+	for (unsigned c = 1; c <= clients; c++)
+		assert(served[c] >= (ops - clients) / (throughput / limits[c % 4]));
+	assert(eligible / ops < clients / 4);
+}
+
+// 13 ops/s of 1500 is 115.38... ticks apart, and must come out exact
+// over any horizon, including across a renormalization of the clock
+static void test_fixed_point() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	const unsigned throughput = 1500, rate = 13, periods = 100;
+	assert(DMClockTestAccess::advanced<Q>(throughput, rate, rate * 1000000)
+			== (int64_t) throughput * 1000000 << 16);
+
+	Q q(throughput, 10);
+	q.set_mClock_trace(false);
+	int64_t &clock = DMClockTestAccess::virtual_clock(q);
+	int64_t start = DMClockTestAccess::epoch_limit<Q>()
+			- throughput * periods / 2;
+	clock = start;
+	SLO r, p;
+	r.reserve = rate;
+	r.prop = 0;
+	r.limit = 0;
+	p.reserve = 0;
+	p.prop = 1;
+	p.limit = 0;
+	for (unsigned i = 0; i < throughput * periods; i++) {
+		q.enqueue_mClock(0u, p, 0, 0);
+		if (i < rate * periods + 10)
+			q.enqueue_mClock(1u, r, 0, 1);
+	}
+	unsigned served = 0;
+	for (unsigned i = 0; i < throughput * periods; i++)
+		served += q.dequeue_mClock();
+	assert(clock < start);
+	assert(served >= rate * periods && served <= rate * periods + 1);
+}
+
+// a weighted class earns rate tokens/sec, fractions carried over,
+// up to its max. a class that can't afford its front item gets there
+// by waiting alone.
+static void test_refill() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	DMClockTestAccess::SubQueue<Q> sq;
+	sq.set_max_tokens(100);
+	sq.refill(utime_t(10, 0), 3); // first look only starts the clock
+	assert(sq.num_tokens() == 0);
+	sq.refill(utime_t(10, 500000000), 3);
+	assert(sq.num_tokens() == 1);
+	sq.refill(utime_t(11, 0), 3);
+	assert(sq.num_tokens() == 3);
+	sq.refill(utime_t(10, 0), 3); // backwards: nothing
+	assert(sq.num_tokens() == 3);
+	sq.refill(utime_t(1000, 0), 3);
+	assert(sq.num_tokens() == 100);
+	sq.take_tokens(100);
+	sq.refill(utime_t(1000, 100000000), 3); // no credit banked at max
+	assert(sq.num_tokens() == 0);
+
+	// class 1 earns 100 tokens/sec, so its first op, costing 10, can
+	// go once it holds 11, after 0.11s. until then class 60 goes first.
+	Q q(1000, 10);
+	q.set_clock_source(CEPH_CLOCK_MANUAL);
+	CachedClock &clock = DMClockTestAccess::clock(q);
+	clock.set(utime_t(100, 0));
+	q.set_token_refill_rate(6100);
+	for (unsigned i = 0; i < 4; i++) {
+		q.enqueue(0u, 1, 10, 1);
+		q.enqueue(0u, 60, 1000, 60);
+	}
+	assert(q.dequeue() == 60);
+	clock.set(utime_t(100, 100000000));
+	assert(q.dequeue() == 60);
+	clock.set(utime_t(100, 200000000));
+	assert(q.dequeue() == 1);
+}
+
+// random traffic over every priority class. after each operation
+// the non-empty and eligible bitmaps must match the classes, and
+// strict dequeues must come highest priority first. a priority past
+// the table is refused.
+static void test_bitmap() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	const unsigned P = 64;
+	Q q(100, 10);
+	vector<Q::Handle> handles;
+	srand(31);
+	for (unsigned i = 0; i < 20000; i++) {
+		unsigned p = rand() % P, cl = rand() % 8;
+		Q::Handle h;
+		switch (rand() % 6) {
+		case 0:
+			q.enqueue_strict(cl, p, p, &h);
+			handles.push_back(h);
+			break;
+		case 1:
+		case 2:
+			q.enqueue(cl, p, rand() % 200, p, &h);
+			handles.push_back(h);
+			break;
+		case 3:
+			if (!q.empty())
+				q.dequeue();
+			break;
+		case 4:
+			if (!handles.empty())
+				q.cancel(handles[rand() % handles.size()]);
+			break;
+		case 5:
+			q.remove_by_class(cl);
+			break;
+		}
+		assert(DMClockTestAccess::masks_match(q));
+	}
+	while (!q.empty())
+		q.dequeue();
+	assert(DMClockTestAccess::masks_match(q));
+	assert(DMClockTestAccess::total_priority(q) == 0);
+
+	// strict classes go highest first, whatever the order queued in
+	unsigned prios[] = { 0, 5, 63, 31, 62, 1 };
+	for (unsigned i = 0; i < 6; i++)
+		q.enqueue_strict(0u, prios[i], prios[i]);
+	sort(prios, prios + 6);
+	for (int i = 5; i >= 0; i--)
+		assert(q.dequeue() == prios[i]);
+
+	Q::Handle h;
+	Q::ClientId id = q.intern_client(0);
+	for (unsigned p = P; p <= P + 1; p++) {
+		assert(q.enqueue_strict(0u, p, p) == -EINVAL);
+		assert(q.enqueue_strict(id, p, p) == -EINVAL);
+		assert(q.enqueue_strict_front(0u, p, p) == -EINVAL);
+		assert(q.enqueue(0u, p, 1, p) == -EINVAL);
+		assert(q.enqueue(id, p, 1, p, &h) == -EINVAL);
+		assert(q.enqueue_front(0u, p, 1, p) == -EINVAL);
+	}
+	assert(q.enqueue_strict(1000u, 255, 0) == -EINVAL);
+	assert(q.priority_length(P) == 0 && q.client_length(1000u) == 0);
+	assert(q.empty() && DMClockTestAccess::masks_match(q));
+	assert(DMClockTestAccess::total_priority(q) == 0);
+	q.release_client(id);
+}
+
+struct Queued {
+	unsigned cl, prio;
+	bool dm;
+};
+
+// the running counters behind length(), client_length(),
+// priority_length() and mClock_length() against a recount of what is
+// actually queued, through every way in and out of the queue
+static void test_depth() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	const unsigned clients = 6, prios = 4;
+	map<unsigned, Queued> queued;
+	vector<Q::Handle> handles;
+	Q q(100, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 10;
+	slo.prop = 1;
+	slo.limit = 0;
+	srand(32);
+	for (unsigned v = 0; v < 20000; v++) {
+		Queued r;
+		r.cl = rand() % clients;
+		r.prio = rand() % prios;
+		r.dm = false;
+		Q::Handle h;
+		list<unsigned> out;
+		unsigned got;
+		switch (rand() % 12) {
+		case 0:
+		case 8:
+			q.enqueue_strict(r.cl, r.prio, v, &h);
+			queued[v] = r;
+			handles.push_back(h);
+			break;
+		case 1:
+		case 9:
+		case 10:
+			q.enqueue(r.cl, r.prio, 10, v, &h);
+			queued[v] = r;
+			handles.push_back(h);
+			break;
+		case 2:
+		case 11:
+			r.dm = true;
+			q.enqueue_mClock(r.cl, slo, 0, v, &h);
+			queued[v] = r;
+			handles.push_back(h);
+			break;
+		case 3:
+			if (q.length() > q.mClock_length())
+				queued.erase(q.dequeue());
+			break;
+		case 4:
+			if (q.mClock_length()) {
+				Q::Charge charge;
+				got = q.dequeue_mClock(0, &charge);
+				if (rand() % 4 == 0) {
+					q.requeue_mClock(queued[got].cl, slo, 0, got, &charge);
+				} else {
+					queued.erase(got);
+				}
+			}
+			break;
+		case 5:
+			if (!handles.empty() && q.cancel(handles[rand() % handles.size()],
+					&got) == 0)
+				queued.erase(got);
+			break;
+		case 6:
+			q.remove_by_class(r.cl, &out);
+			break;
+		case 7:
+			q.remove_by_filter(bind2nd(equal_to<unsigned>(), v - 1), &out);
+			break;
+		}
+		for (list<unsigned>::iterator i = out.begin(); i != out.end(); ++i)
+			queued.erase(*i);
+
+		vector<unsigned> by_client(clients), by_prio(prios);
+		unsigned dm = 0;
+		for (map<unsigned, Queued>::iterator i = queued.begin(); i != queued.end();
+				++i) {
+			by_client[i->second.cl]++;
+			if (i->second.dm)
+				dm++;
+			else
+				by_prio[i->second.prio]++;
+		}
+		assert(q.length() == queued.size());
+		assert(q.empty() == queued.empty());
+		assert(q.mClock_length() == dm);
+		for (unsigned c = 0; c < clients; c++)
+			assert(q.client_length(c) == by_client[c]);
+		for (unsigned p = 0; p < prios; p++)
+			assert(q.priority_length(p) == by_prio[p]);
+	}
+}
+
+struct Throttles: public PrioritizedQueueDMClock<unsigned, unsigned>::AdmissionListener {
+	vector<pair<unsigned, bool> > events; // client, throttled
+	void throttle(const unsigned &cl) {
+		events.push_back(make_pair(cl, true));
+	}
+	void unthrottle(const unsigned &cl) {
+		events.push_back(make_pair(cl, false));
+	}
+};
+
+// a client over its own cap gets -EAGAIN and everyone gets -ENOSPC
+// while the queue as a whole is full. each refusal throttles the
+// client once, until it, and the total if that was full, drains to
+// the low water mark.
+static void test_admission() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	Q q(1000, 1);
+	q.set_mClock_trace(false);
+	Q::AdmissionLimits limits;
+	limits.client_items = 4;
+	limits.total_items = 10;
+	limits.client_bytes = 1000;
+	limits.low_water = 50;
+	q.set_admission_limits(limits);
+	Throttles t;
+	q.set_admission_listener(&t);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+
+	for (unsigned i = 0; i < 4; i++)
+		assert(q.enqueue_mClock(1u, slo, 10, 1) == 0);
+	assert(q.enqueue_mClock(1u, slo, 10, 1) == -EAGAIN);
+	assert(q.enqueue(1u, 3, 10, 1) == -EAGAIN);
+	assert(t.events.size() == 1 && t.events[0] == make_pair(1u, true));
+	q.dequeue_mClock();
+	assert(t.events.size() == 1);
+	q.dequeue_mClock(); // 2 left, half the cap
+	assert(t.events.size() == 2 && t.events[1] == make_pair(1u, false));
+	assert(q.enqueue_mClock(1u, slo, 10, 1) == 0);
+
+	// bytes: an idle client gets one item in however large
+	assert(q.enqueue_mClock(2u, slo, 5000, 2) == 0);
+	assert(q.enqueue_mClock(2u, slo, 1, 2) == -EAGAIN);
+	assert(t.events.size() == 3 && t.events[2] == make_pair(2u, true));
+
+	// fill the total up to 10 with new clients, then everyone is out
+	for (unsigned c = 3; q.length() < 10; c++)
+		assert(q.enqueue_mClock(c, slo, 10, c) == 0);
+	assert(q.enqueue_mClock(20u, slo, 10, 20) == -ENOSPC);
+	assert(q.enqueue(21u, 3, 10, 21) == -ENOSPC);
+	assert(q.enqueue_mClock(20u, slo, 10, 20) == -ENOSPC);
+	assert(t.events.size() == 5);
+	assert(t.events[3] == make_pair(20u, true));
+	assert(t.events[4] == make_pair(21u, true));
+	while (q.length() > 5)
+		q.dequeue_mClock();
+	bool released[22] = { false };
+	for (size_t i = 5; i < t.events.size(); i++) {
+		assert(!t.events[i].second);
+		released[t.events[i].first] = true;
+	}
+	assert(released[20] && released[21]);
+	assert(q.enqueue_mClock(20u, slo, 10, 20) == 0);
+}
+
+static bool is_odd(const unsigned &v) {
+	return v % 2;
+}
+
+// removals hand items back in an order that does not depend on when
+// clients were interned: as elsewhere, each client's items go to the
+// front of out, in queue order, and clients are visited in key order.
+// the dmClock tags and counters must be fit to carry on with after.
+static void test_remove() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	Q q(1000, 1);
+	q.set_mClock_trace(false);
+	unsigned d = q.add_mClock_device(1000);
+	SLO slo;
+	slo.reserve = 10;
+	slo.prop = 1;
+	slo.limit = 0;
+	// client c queues c * 100 + i, interned in reverse key order
+	for (unsigned c = 5; c >= 1; c--)
+		for (unsigned i = 0; i < 6; i++)
+			q.enqueue_mClock(c, slo, 0, c * 100 + i);
+	Q::ClientId three = q.intern_client(3);
+	q.set_mClock_slo(three, d, slo);
+	assert(q.enqueue_mClock(three, d, 0, 399) == 0);
+
+	list<unsigned> out;
+	q.remove_by_filter(is_odd, &out);
+	const unsigned order[] = { 399, 501, 503, 505, 401, 403, 405, 301, 303,
+			305, 201, 203, 205, 101, 103, 105 };
+	assert(out.size() == 16);
+	assert(equal(out.begin(), out.end(), order));
+	assert(q.mClock_length() == 15 && q.mClock_length(d) == 0);
+
+	out.clear();
+	q.remove_by_class(2u, &out);
+	assert(out.size() == 3);
+	assert(out.front() == 200 && out.back() == 204);
+	assert(q.client_length(2u) == 0);
+
+	// a client emptied by a removal goes idle and can come back
+	q.remove_by_class(4u);
+	q.enqueue_mClock(4u, slo, 0, 406);
+	assert(q.mClock_length() == 10);
+	unsigned seen[6] = { 0 };
+	while (q.mClock_length()) {
+		unsigned v = q.dequeue_mClock();
+		assert(v % 2 == 0);
+		seen[v / 100]++;
+	}
+	assert(seen[1] == 3 && seen[2] == 0 && seen[3] == 3);
+	assert(seen[4] == 1 && seen[5] == 3);
+	assert(q.empty());
+}
+
+// a handle cancels its item from whichever queue holds it, once.
+// after that, or once the item is dequeued, it is stale and gets
+// -ENOENT, even when its pool entry has been reused.
+static void test_cancel() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	Q q(1000, 1);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	Q::Handle hs, hw, hd[3];
+	q.enqueue_strict(1u, 5, 10, &hs);
+	q.enqueue(1u, 3, 10, 11, &hw);
+	for (unsigned i = 0; i < 3; i++)
+		q.enqueue_mClock(2u, slo, 0, 20 + i, &hd[i]);
+	assert(q.length() == 5);
+
+	unsigned out = 0;
+	assert(q.cancel(hw, &out) == 0 && out == 11);
+	assert(q.cancel(hw, &out) == -ENOENT);
+	assert(q.cancel(hd[0], &out) == 0 && out == 20);
+	assert(q.cancel(hs) == 0);
+	assert(q.length() == 2 && q.priority_length(3) == 0);
+
+	// the freed entries are reused; the old handles stay stale
+	Q::Handle h2;
+	q.enqueue(1u, 3, 10, 12, &h2);
+	assert(q.cancel(hw) == -ENOENT && q.cancel(hs) == -ENOENT);
+	assert(q.dequeue() == 12);
+	assert(q.cancel(h2) == -ENOENT);
+
+	// dequeued items can't be cancelled
+	assert(q.dequeue_mClock() == 21);
+	assert(q.cancel(hd[1]) == -ENOENT);
+	assert(q.cancel(hd[2], &out) == 0 && out == 22);
+	assert(q.empty() && q.client_length(2u) == 0);
+
+	// a client emptied by cancel goes idle and comes back
+	q.enqueue_mClock(2u, slo, 0, 23);
+	assert(q.dequeue_mClock() == 23);
+}
+
+// clients with the given SLOs queue and are served at random; what
+// was served, in order
+template<typename Policy>
+static vector<unsigned> served_order(const vector<SLO> &slos) {
+	PrioritizedQueueDMClock<unsigned, unsigned, Policy> q(1000, 10);
+	q.set_mClock_trace(false);
+	vector<unsigned> order;
+	srand(36);
+	for (unsigned i = 0; i < 20000; i++) {
+		unsigned c = rand() % slos.size();
+		q.enqueue_mClock(c, slos[c], 0, c);
+		if (rand() % 3)
+			order.push_back(q.dequeue_mClock());
+	}
+	while (!q.empty())
+		order.push_back(q.dequeue_mClock());
+	return order;
+}
+
+// the narrow policies only drop tags their clients don't use, so they
+// must serve exactly as the full scheduler does
+static void test_policy() {
+	vector<SLO> prop(8), rl(8);
+	for (unsigned c = 0; c < 8; c++) {
+		prop[c].reserve = 0;
+		prop[c].prop = 1 + c;
+		prop[c].limit = 0;
+		rl[c].reserve = 10 + 20 * c;
+		rl[c].prop = 0;
+		rl[c].limit = c % 2 ? 0 : 50 + 40 * c;
+	}
+	vector<unsigned> full = served_order<DMClockFull>(prop);
+	assert(full.size() == 20000);
+	assert(served_order<DMClockPropOnly>(prop) == full);
+	full = served_order<DMClockFull>(rl);
+	assert(full.size() == 20000);
+	assert(served_order<DMClockReserveLimit>(rl) == full);
+}
+
+// clients stay on the node they are bound to until forgotten. each
+// shard counts the reservations of the clients it holds, following SLO
+// changes and dropping them when clients are forgotten, and balance()
+// hands out the reserved throughput plus the rest by demand.
+static void test_numa() {
+	NumaTopology topo;
+	topo.simulate(2);
+	NumaDMClock<unsigned, unsigned> q(topo, 1000, 10);
+	assert(q.nodes() == 2);
+	SLO slo;
+	slo.reserve = 100;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned c = 0; c < 4; c++)
+		assert(q.bind_client(c, c % 2) == 0);
+	assert(q.bind_client(1, 0) == -EEXIST);
+	assert(q.bind_client(1, 1) == 0);
+	for (unsigned i = 0; i < 40; i++)
+		assert(q.enqueue_mClock(i % 4, slo, 0, i % 4) == 0);
+	assert(q.length(0) == 20 && q.length(1) == 20);
+	assert(q.reserved(0) == 200 && q.reserved(1) == 200);
+
+	// one client moves to a bigger reservation
+	slo.reserve = 300;
+	assert(q.enqueue_mClock(3u, slo, 0, 3) == 0);
+	assert(q.reserved(1) == 400);
+
+	// 600 reserved, 400 spare, all demand so far on node 1 but one op
+	q.balance();
+	assert(q.get_throughput(0) + q.get_throughput(1) <= 1000);
+	assert(q.get_throughput(0) >= 200 && q.get_throughput(1) >= 400);
+
+	unsigned v;
+	for (unsigned n = 0; n < 2; n++)
+		while (q.dequeue_mClock(n, &v) == 0)
+			assert(v % 2 == n);
+	assert(q.dequeue_mClock(0, &v) == -EAGAIN);
+	q.purge();
+	assert(q.reserved(0) == 0 && q.reserved(1) == 0);
+
+	// forgotten clients start afresh, on the enqueuing thread's node
+	slo.reserve = 50;
+	assert(q.enqueue_mClock(1u, slo, 0, 1) == 0);
+	assert(q.reserved(0) + q.reserved(1) == 50);
+	// which then has all the demand; the other keeps a floor of 1
+	unsigned n = q.reserved(0) ? 0 : 1;
+	q.balance();
+	assert(q.get_throughput(n) == 1000 && q.get_throughput(!n) == 1);
+
+	// and once forgotten again may move: its reservation goes with it,
+	// and enqueues from either node find it there
+	while (q.dequeue_mClock(n, &v) == 0)
+		;
+	q.purge();
+	q.balance();
+	assert(q.bind_client(1, !n) == 0 && q.bind_client(1, n) == -EEXIST);
+	for (unsigned i = 0; i < 10; i++)
+		assert(q.enqueue_mClock(1u, slo, 0, 1) == 0);
+	assert(q.length(!n) == 10 && q.length(n) == 0);
+	assert(q.reserved(!n) == 50 && q.reserved(n) == 0);
+}
+
+// a thief only gets proportional-phase work: while a reservation is
+// due it gets -EAGAIN and nothing moves. across shards every request
+// is served once, by its own node's worker or by a thief.
+static void test_steal() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	Q q(1000, 10);
+	q.set_mClock_trace(false);
+	SLO r, p;
+	r.reserve = 500;
+	r.prop = 0;
+	r.limit = 0;
+	p.reserve = 0;
+	p.prop = 1;
+	p.limit = 0;
+	for (unsigned i = 0; i < 10; i++) {
+		q.enqueue_mClock(1u, r, 0, 1);
+		q.enqueue_mClock(2u, p, 0, 2);
+	}
+	unsigned v = 0;
+	assert(q.steal_mClock(&v) == -EAGAIN && q.mClock_length() == 20);
+	assert(q.dequeue_mClock() == 1);
+	assert(q.steal_mClock(&v) == 0 && v == 2);
+	assert(q.steal_mClock(&v) == -EAGAIN);
+	q.set_mClock_window(1);
+	assert(q.steal_mClock(&v) == -EBUSY);
+
+	NumaTopology topo;
+	topo.simulate(2);
+	NumaDMClock<unsigned, unsigned> n(topo, 1000, 10);
+	const unsigned clients = 16, depth = 50;
+	for (unsigned c = 0; c < clients; c++) {
+		n.bind_client(c, 0);
+		for (unsigned i = 0; i < depth; i++)
+			n.enqueue_mClock(c, p, 0, c * depth + i);
+	}
+	vector<bool> served(clients * depth);
+	unsigned own = 0, stolen = 0;
+	assert(n.steal_mClock(0, &v) == -EAGAIN); // nothing on node 1
+	for (;;) {
+		if (n.dequeue_mClock(0, &v) == 0)
+			own++;
+		else
+			break;
+		assert(!served[v]);
+		served[v] = true;
+		if (n.steal_mClock(1, &v) == 0) {
+			stolen++;
+			assert(!served[v]);
+			served[v] = true;
+		}
+	}
+	assert(own + stolen == clients * depth);
+	assert(stolen >= own - 1);
+}
+
+struct Stager {
+	PrioritizedQueueDMClock<unsigned, unsigned> *q;
+	unsigned id, ops;
+	uint64_t refused;
+};
+
+// producer id stages id * ops + i, in order, as client id
+static void *stage_in_order(void *arg) {
+	Stager *s = (Stager *) arg;
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned i = 0; i < s->ops; i++) {
+		int r;
+		while ((r = s->q->stage_mClock(s->id, slo, 0, s->id * s->ops + i))
+				== -EAGAIN) {
+			s->refused++;
+			sched_yield();
+		}
+		assert(r == 0);
+	}
+	return NULL;
+}
+
+// producers stage through a ring far smaller than their work while
+// the consumer dequeues. every request arrives once and each client's
+// in the order staged; a full ring refuses, and counts it.
+static void test_intake() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	const unsigned producers = 4, ops = 20000;
+	Q q(100000, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	assert(q.stage_mClock(0u, slo, 0, 0) == -EINVAL);
+	q.set_mClock_intake(64);
+
+	vector<Stager> s(producers);
+	vector<pthread_t> tid(producers);
+	for (unsigned p = 0; p < producers; p++) {
+		s[p].q = &q;
+		s[p].id = p;
+		s[p].ops = ops;
+		s[p].refused = 0;
+		pthread_create(&tid[p], NULL, stage_in_order, &s[p]);
+	}
+	vector<int> last(producers, -1);
+	for (unsigned n = 0; n < producers * ops;) {
+		if (q.empty()) {
+			sched_yield();
+			continue;
+		}
+		unsigned v = q.dequeue_mClock();
+		unsigned p = v / ops;
+		assert(p < producers && (int) (v % ops) == last[p] + 1);
+		last[p] = v % ops;
+		n++;
+	}
+	uint64_t refused = 0;
+	for (unsigned p = 0; p < producers; p++) {
+		pthread_join(tid[p], NULL);
+		refused += s[p].refused;
+	}
+	assert(q.empty());
+	assert(q.get_mClock_intake_overflows() == refused);
+}
+
+// reservation-only clients leave 40% of the device idle by default;
+// work conserving hands those slots out early, split by reservation.
+// a reserved client that runs dry holds the device for up to the
+// anticipation window, and is served first if it returns within it.
+static void test_idle() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	for (int wc = 0; wc < 2; wc++) {
+		const unsigned slots = 3000;
+		Q q(1000, 10);
+		q.set_mClock_trace(false);
+		q.set_mClock_work_conserving(wc);
+		SLO slo;
+		slo.prop = 0;
+		slo.limit = 0;
+		for (unsigned c = 0; c < 3; c++) {
+			slo.reserve = 100 * (c + 1);
+			for (unsigned j = 0; j < slots; j++)
+				q.enqueue_mClock(c, slo, 0, c);
+		}
+		unsigned ops[3] = { 0, 0, 0 };
+		for (unsigned s = 0; s < slots; s++) {
+			unsigned v;
+			if (q.try_dequeue_mClock(&v) == 0)
+				ops[v]++;
+		}
+		unsigned total = ops[0] + ops[1] + ops[2];
+		assert(total + q.get_mClock_idle_cycles() == slots);
+		assert(total == (wc ? slots : slots * 6 / 10));
+		assert(ops[1] == 2 * ops[0] && ops[2] == 3 * ops[0]);
+	}
+
+	SLO s0, s1;
+	s0.reserve = 500;
+	s0.prop = 0;
+	s0.limit = 0;
+	s1.reserve = 0;
+	s1.prop = 10;
+	s1.limit = 0;
+	for (int window = 0; window <= 4; window += 4) {
+		Q q(1000, 10);
+		q.set_mClock_trace(false);
+		q.set_mClock_work_conserving(true, window);
+		for (unsigned j = 0; j < 100; j++)
+			q.enqueue_mClock(1, s1, 0, 1);
+		q.enqueue_mClock(0, s0, 0, 0);
+		unsigned v = 1;
+		while (v != 0)
+			assert(q.try_dequeue_mClock(&v) == 0);
+		// client 0 is ahead of its reservation: the slot goes to
+		// client 1 either way
+		assert(q.try_dequeue_mClock(&v) == 0 && v == 1);
+		uint64_t idle = q.get_mClock_idle_cycles();
+		if (!window) {
+			// nothing to wait for
+			assert(q.try_dequeue_mClock(&v) == 0 && v == 1);
+			continue;
+		}
+		// now it is due again, so the device waits for it
+		assert(q.try_dequeue_mClock(&v) == -EAGAIN);
+		assert(q.get_mClock_idle_cycles() == idle + 1);
+		q.enqueue_mClock(0, s0, 0, 0);
+		while (q.try_dequeue_mClock(&v) == -EAGAIN)
+			;
+		assert(v == 0);
+		// it does not come back: the hold lapses within the window
+		unsigned held = 0;
+		while (q.try_dequeue_mClock(&v) == -EAGAIN)
+			held++;
+		assert(v == 1 && held < (unsigned) window);
+	}
+
+	// a dependent client that keeps up with its reservation is not
+	// waited for, so the backlogged client still gets its share
+	for (int window = 0; window <= 3; window += 3) {
+		unsigned ops[2];
+		simulate_dependent(500, window, 2000, ops);
+		assert(ops[0] >= 150 && ops[1] >= 150);
+	}
+}
+
+// every monotonic source only moves forward and agrees with
+// CLOCK_MONOTONIC to within its resolution. a tsc clock resyncing
+// every millisecond stays close across many resyncs and across a gap
+// of many intervals with no reads; a cached clock holds one time per
+// pass.
+static void test_clock() {
+	const uint64_t ms = 1000000;
+	for (int s = CEPH_CLOCK_MONOTONIC; s <= CEPH_CLOCK_TSC; s++) {
+		uint64_t prev = ceph_clock_read_ns(s);
+		for (unsigned i = 0; i < 100000; i++) {
+			uint64_t t = ceph_clock_read_ns(s);
+			assert(t >= prev);
+			prev = t;
+		}
+		uint64_t m = ceph_clock_read_ns(CEPH_CLOCK_MONOTONIC);
+		assert(prev <= m + 20 * ms && m <= prev + 20 * ms);
+	}
+	assert(ceph_clock_read(CEPH_CLOCK_REALTIME).sec() - time(NULL) + 1 <= 2);
+
+	TscClock tsc(ms);
+	uint64_t prev = tsc.now_ns();
+	int64_t worst = 0;
+	double end = now_sec() + 0.2;
+	while (now_sec() < end) {
+		uint64_t m0 = ceph_clock_gettime_ns(CLOCK_MONOTONIC);
+		uint64_t t = tsc.now_ns();
+		uint64_t m1 = ceph_clock_gettime_ns(CLOCK_MONOTONIC);
+		assert(t >= prev);
+		prev = t;
+		int64_t err = t < m0 ? m0 - t : (t > m1 ? t - m1 : 0);
+		worst = max(worst, err);
+	}
+	assert(worst < (int64_t) ms);
+	usleep(100000);
+	uint64_t m = ceph_clock_gettime_ns(CLOCK_MONOTONIC);
+	uint64_t t = tsc.now_ns();
+	assert(t >= prev && t + ms >= m && t <= m + ms);
+
+	CachedClock cached;
+	utime_t a = cached.now();
+	usleep(2000);
+	assert(cached.now() == a);
+	cached.begin_pass();
+	assert(cached.now() > a);
+
+	// a manual clock holds what it was set to, across passes
+	CachedClock manual(CEPH_CLOCK_MANUAL);
+	manual.set(utime_t(5, 0));
+	manual.begin_pass();
+	assert(manual.now() == utime_t(5, 0));
+}
+
+// the utime_t fast paths print what libc prints, UTC and local, for
+// times across leap days and centuries, and parse their own UTC
+// output back to the same time. bad input and short buffers fail.
+static void test_utime() {
+	char buf[64], want[64];
+	uint64_t x = 88172645463325252ull;
+	for (unsigned i = 0; i < 200000; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		// 1980 to 2100, then a run a few microseconds apart
+		utime_t t = i < 100000 ?
+				utime_t(315532800 + x % 3786912000u, x % 1000000 * 1000) :
+				utime_t(1435226400, 0) + utime_t(0, i * 3000);
+		struct tm bdt;
+		time_t tt = t.sec();
+		gmtime_r(&tt, &bdt);
+		snprintf(want, sizeof(want), "%04d-%02d-%02d %02d:%02d:%02d.%06ldZ",
+				bdt.tm_year + 1900, bdt.tm_mon + 1, bdt.tm_mday, bdt.tm_hour,
+				bdt.tm_min, bdt.tm_sec, (long) t.usec());
+		assert(t.gmtime(buf, sizeof(buf)) == (int) strlen(want));
+		assert(strcmp(buf, want) == 0);
+		uint64_t epoch, nsec;
+		assert(utime_t::parse_iso8601(buf, &epoch, &nsec) == 0);
+		assert(epoch == (uint64_t) t.sec() && nsec == t.usec() * 1000ull);
+
+		localtime_r(&tt, &bdt);
+		snprintf(want, sizeof(want), "%04d-%02d-%02d %02d:%02d:%02d.%06ld",
+				bdt.tm_year + 1900, bdt.tm_mon + 1, bdt.tm_mday, bdt.tm_hour,
+				bdt.tm_min, bdt.tm_sec, (long) t.usec());
+		assert(t.localtime(buf, sizeof(buf)) == (int) strlen(want));
+		assert(strcmp(buf, want) == 0);
+	}
+
+	uint64_t epoch, nsec;
+	assert(utime_t::parse_iso8601("2016-02-29", &epoch, &nsec) == 0);
+	assert(epoch == 1456704000 && nsec == 0);
+	assert(utime_t::parse_iso8601("2015-06-25T10:11:12.5Z", &epoch, &nsec)
+			== 0);
+	assert(epoch == 1435227072 && nsec == 500000000);
+	const char *bad[] = { "2015-06-25 10:11", "2015-13-01", "2015-06-25 24:00:00",
+			"2015-06-25 10:11:12.", "2015-06-25x", "15-06-25" };
+	for (unsigned i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+		assert(utime_t::parse_iso8601(bad[i], &epoch, &nsec) == -EINVAL);
+
+	utime_t rel(42, 7000);
+	assert(rel.gmtime(buf, sizeof(buf)) == 9 && strcmp(buf, "42.000007") == 0);
+	assert(rel.gmtime(buf, 9) == -ERANGE && buf[0] == '\0');
+}
+
+// three backlogged classes at one priority whose ops cost 100, 300
+// and 700. round robin serves them item for item, so cost goes 1:3:7;
+// deficit round robin keeps the cost each has been served within
+// about a quantum of the others at every point, and each class's own
+// items stay in order.
+static void test_drr() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	const unsigned costs[3] = { 100, 300, 700 }, rounds = 3000;
+	for (int drr = 0; drr < 2; drr++) {
+		Q q(1000, 10);
+		q.set_deficit_round_robin(drr);
+		for (unsigned c = 0; c < 3; c++)
+			for (unsigned i = 0; i < rounds * 7 / (c * 2 + 1); i++)
+				q.enqueue(c, 10, costs[c], c * 100000 + i);
+		uint64_t cost[3] = { 0, 0, 0 };
+		unsigned next[3] = { 0, 0, 0 };
+		for (unsigned n = 0; n < rounds; n++) {
+			unsigned v = q.dequeue(), c = v / 100000;
+			assert(v % 100000 == next[c]++);
+			cost[c] += costs[c];
+			if (drr) {
+				uint64_t lo = min(cost[0], min(cost[1], cost[2]));
+				uint64_t hi = max(cost[0], max(cost[1], cost[2]));
+				assert(hi - lo <= 1000 + 700);
+			}
+		}
+		if (!drr)
+			assert(next[0] == next[1] && next[1] == next[2]);
+	}
+}
+
+// served counts per client over the next ops dequeues
+static vector<unsigned> serve(PrioritizedQueueDMClock<unsigned, unsigned> &q,
+		unsigned ops) {
+	vector<unsigned> n(4);
+	for (unsigned i = 0; i < ops; i++)
+		n[q.dequeue_mClock()]++;
+	return n;
+}
+
+// client 0 reserves 400 of 1000 and the proportional clients split
+// the rest by weight. as clients join and leave, and after a churn of
+// many short lived ones, the split follows the current weights.
+static void test_join() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	Q q(1000, 10);
+	q.set_mClock_trace(false);
+	q.set_mClock_idle_ttl(1);
+	SLO slo;
+	slo.reserve = 400;
+	slo.prop = 0;
+	slo.limit = 0;
+	for (unsigned i = 0; i < 10000; i++)
+		q.enqueue_mClock(0u, slo, 0, 0);
+	slo.reserve = 0;
+	slo.prop = 1;
+	for (unsigned i = 0; i < 10000; i++)
+		q.enqueue_mClock(1u, slo, 0, 1);
+	slo.prop = 3;
+	for (unsigned i = 0; i < 10000; i++)
+		q.enqueue_mClock(2u, slo, 0, 2);
+	vector<unsigned> n = serve(q, 1000);
+	assert(n[0] == 400 && n[1] == 150 && n[2] == 450 && n[3] == 0);
+
+	slo.prop = 4;
+	for (unsigned i = 0; i < 10000; i++)
+		q.enqueue_mClock(3u, slo, 0, 3);
+	n = serve(q, 1000);
+	assert(n[0] == 400 && n[1] == 75 && n[2] == 225 && n[3] == 300);
+
+	q.remove_by_class(2u);
+	n = serve(q, 1000);
+	assert(n[0] == 400 && n[1] == 120 && n[2] == 0 && n[3] == 480);
+
+	slo.prop = 1;
+	for (unsigned c = 100; c < 1100; c++) {
+		q.enqueue_mClock(c, slo, 0, 1);
+		q.dequeue_mClock();
+		q.dequeue_mClock();
+	}
+	q.purge_mClock();
+	n = serve(q, 1000);
+	assert(n[0] == 400 && n[1] == 120 && n[2] == 0 && n[3] == 480);
+}
+
+struct ForgottenKeys: public PrioritizedQueueDMClock<unsigned, string>::ClientListener {
+	vector<string> keys;
+	void forget(const string &cl) {
+		keys.push_back(cl);
+	}
+};
+
+// a key keeps its id for as long as anything holds it: an interned
+// client outlives idle reclaim of its tags. once released and idle the
+// key is forgotten, and the next new keys take over its id, without
+// the old client's SLOs.
+static void test_intern() {
+	typedef PrioritizedQueueDMClock<unsigned, string> Q;
+	Q q(1000, 10);
+	q.set_mClock_trace(false);
+	ForgottenKeys f;
+	q.set_client_listener(&f);
+	q.set_mClock_idle_ttl(10);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+
+	Q::ClientId a = q.intern_client("client.a");
+	Q::ClientId b = q.intern_client("client.b");
+	assert(q.intern_client("client.a").id == a.id && a.id != b.id);
+	assert(q.client_key(a) == "client.a" && q.client_key(b) == "client.b");
+	q.set_mClock_slo(a, 0, slo);
+	assert(q.enqueue_mClock(a, 0u, 0, 1) == 0);
+	assert(q.enqueue_mClock(string("client.a"), slo, 0, 2) == 0);
+	assert(q.client_length(a) == 2 && q.client_length("client.a") == 2);
+	assert(q.dequeue_mClock() == 1 && q.dequeue_mClock() == 2);
+
+	// long past the ttl, a's tags are gone but both interns hold it
+	for (unsigned i = 0; i < 100; i++) {
+		q.enqueue_mClock(string("busy"), slo, 0, 0);
+		q.dequeue_mClock();
+	}
+	assert(f.keys.empty());
+	q.release_client(a);
+	assert(f.keys.empty());
+	q.release_client(a);
+	q.release_client(b);
+	assert(f.keys.size() == 2);
+	assert(count(f.keys.begin(), f.keys.end(), "client.a") == 1);
+	assert(count(f.keys.begin(), f.keys.end(), "client.b") == 1);
+	assert(q.client_length("client.a") == 0);
+
+	Q::ClientId c = q.intern_client("client.c");
+	Q::ClientId d = q.intern_client("client.d");
+	assert(c.id != d.id && (c.id == a.id || c.id == b.id)
+			&& (d.id == a.id || d.id == b.id));
+	assert(q.client_key(c) == "client.c" && q.client_key(d) == "client.d");
+	assert(q.enqueue_mClock(c.id == a.id ? c : d, 0u, 0, 3) == -ENOENT);
+	// and a forgotten key comes back under a new id
+	Q::ClientId a3 = q.intern_client("client.a");
+	assert(a3.id != c.id && a3.id != d.id && q.client_key(a3) == "client.a");
+}
+
+// a reservation of 100 is a tenth of a 1000 op/s device and half of
+// a 200 op/s one. each device keeps its own tags, so the weights a
+// client holds on one do not carry over to the other, and serving one
+// device leaves the other's order alone. staged and stolen work stays
+// on the device it names.
+static void test_devices() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	const unsigned ops = 1000;
+	Q q(1000, 10);
+	q.set_mClock_trace(false);
+	unsigned hdd = q.add_mClock_device(200);
+	assert(hdd == 1 && q.mClock_devices() == 2);
+	Q::ClientId r = q.intern_client(0), p = q.intern_client(1),
+			w = q.intern_client(2);
+	SLO slo;
+	slo.reserve = 100;
+	slo.prop = 0;
+	slo.limit = 0;
+	q.set_mClock_slo(r, 0, slo);
+	q.set_mClock_slo(r, hdd, slo);
+	slo.reserve = 0;
+	slo.prop = 1;
+	q.set_mClock_slo(p, 0, slo);
+	q.set_mClock_slo(w, hdd, slo);
+	slo.prop = 3;
+	q.set_mClock_slo(w, 0, slo);
+	q.set_mClock_slo(p, hdd, slo);
+	for (unsigned i = 0; i < 2 * ops; i++)
+		for (unsigned d = 0; d < 2; d++) {
+			assert(q.enqueue_mClock(r, d, 0, 0) == 0);
+			assert(q.enqueue_mClock(p, d, 0, 1) == 0);
+			assert(q.enqueue_mClock(w, d, 0, 2) == 0);
+		}
+	assert(q.mClock_length(0) == 6 * ops && q.mClock_length(hdd) == 6 * ops);
+
+	unsigned served[2][3] = { { 0 } };
+	for (unsigned i = 0; i < ops; i++)
+		served[0][q.dequeue_mClock(0)]++;
+	assert(q.mClock_length(0) == 5 * ops && q.mClock_length(hdd) == 6 * ops);
+	for (unsigned i = 0; i < ops; i++)
+		served[1][q.dequeue_mClock(hdd)]++;
+	assert(served[0][0] == 100 && served[0][1] == 225 && served[0][2] == 675);
+	assert(served[1][0] == 500 && served[1][1] == 375 && served[1][2] == 125);
+
+	// steal only takes proportional work, from the device asked for
+	unsigned v;
+	for (unsigned i = 0; i < 100; i++) {
+		int ret = q.steal_mClock(&v, hdd);
+		assert(ret == -EAGAIN || (ret == 0 && v != 0));
+	}
+	assert(q.mClock_length(0) == 5 * ops);
+
+	q.set_mClock_intake(16);
+	for (unsigned d = 0; d < 2; d++)
+		while (q.mClock_length(d))
+			q.dequeue_mClock(d);
+	assert(q.stage_mClock(7, slo, 0, 7, hdd) == 0);
+	assert(q.mClock_length(hdd) == 0 && !q.empty());
+	assert(q.steal_mClock(&v, 0) == -EAGAIN);
+	assert(q.mClock_length(0) == 0 && q.mClock_length(hdd) == 1);
+	assert(q.dequeue_mClock(hdd) == 7 && q.empty());
+}
+
+// dispatch a full window, complete it all with latency, and return
+// the window size it leaves behind
+static unsigned window_round(PrioritizedQueueDMClock<unsigned, unsigned> &q,
+		uint64_t latency) {
+	unsigned n = 0, v;
+	while (q.try_dequeue_mClock(&v) == 0)
+		n++;
+	assert(n == q.get_mClock_window() && q.get_mClock_in_flight() == n);
+	while (n--)
+		q.mClock_completed(latency);
+	return q.get_mClock_window();
+}
+
+// nothing more is dispatched while the window is full, though the
+// queue still counts what it holds; each completion lets one more out,
+// in order. other queues carry on. an adaptive window grows by one per round that
+// stays under target and gives up a quarter on a late one.
+static void test_window() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	Q q(1000, 10);
+	q.set_mClock_trace(false);
+	q.set_mClock_window(4);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned i = 1; i <= 10; i++)
+		q.enqueue_mClock(0u, slo, 0, i);
+	assert(q.dispatchable_length() == 4);
+	for (unsigned i = 1; i <= 4; i++)
+		assert(q.dequeue_mClock() == i);
+	assert(q.length() == 6 && q.mClock_length() == 6 && !q.empty());
+	assert(q.dispatchable_length() == 0);
+	assert(q.get_mClock_in_flight() == 4);
+	unsigned v;
+	assert(q.try_dequeue_mClock(&v) == -EBUSY);
+	assert(q.steal_mClock(&v) == -EBUSY);
+	q.enqueue_strict(1u, 10, 100);
+	assert(q.length() == 7 && q.dequeue() == 100);
+	q.mClock_completed();
+	assert(q.dispatchable_length() == 1);
+	assert(q.dequeue_mClock() == 5 && q.try_dequeue_mClock(&v) == -EBUSY);
+	q.mClock_completed();
+	q.mClock_dispatched();
+	assert(q.try_dequeue_mClock(&v) == -EBUSY);
+	assert(q.get_mClock_in_flight() == 4 && q.length() == 5);
+	q.set_mClock_window(0);
+	assert(q.dispatchable_length() == 5);
+	while (!q.empty())
+		q.dequeue_mClock();
+	assert(q.mClock_length() == 0);
+
+	Q a(1000, 10);
+	a.set_mClock_trace(false);
+	a.set_mClock_adaptive_window(100, 1, 8);
+	for (unsigned i = 0; i < 1000; i++)
+		a.enqueue_mClock(0u, slo, 0, 1);
+	for (unsigned limit = 1; limit < 8; limit++)
+		assert(a.get_mClock_window() == limit
+				&& window_round(a, 100) == limit + 1);
+	assert(window_round(a, 50) == 8);
+	const unsigned shrink[] = { 6, 4, 3, 2, 1, 1 };
+	for (unsigned i = 0; i < 6; i++)
+		assert(window_round(a, 101) == shrink[i]);
+}
+
+static WriteOp write_op(unsigned client, uint64_t off) {
+	WriteOp op;
+	op.client = client;
+	op.off = off;
+	op.len = 4096;
+	return op;
+}
+
+// a dequeue folds in the client's next requests for as long as they
+// are contiguous, up to max_ops of them and the hook's 128k, and
+// counts each one out of the queue. each merged request is charged,
+// so a sequential client gets no more requests served than a random
+// one with the same share.
+static void test_merge() {
+	WriteQueue q(100000, 10);
+	q.set_mClock_trace(false);
+	SequentialMerge hook;
+	q.set_mClock_merge(&hook, 4);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned i = 0; i < 10; i++)
+		q.enqueue_mClock(0u, slo, 4096, write_op(0, i * 4096));
+	for (unsigned i = 0; i < 4; i++)
+		q.enqueue_mClock(0u, slo, 4096, write_op(0, (256 + i) * 4096));
+	const uint64_t off[] = { 0, 16384, 32768, 1048576 };
+	const unsigned len[] = { 16384, 16384, 8192, 16384 }, left[] = { 10, 6,
+			4, 0 };
+	for (unsigned i = 0; i < 4; i++) {
+		WriteOp op = q.dequeue_mClock();
+		assert(op.off == off[i] && op.len == len[i]);
+		assert(q.mClock_length() == left[i] && q.client_length(0u) == left[i]);
+	}
+	assert(q.empty());
+
+	q.set_mClock_merge(&hook, 64);
+	for (unsigned i = 0; i < 40; i++)
+		q.enqueue_mClock(0u, slo, 4096, write_op(0, i * 4096));
+	assert(q.dequeue_mClock().len == 131072 && q.mClock_length() == 8);
+	assert(q.dequeue_mClock().len == 32768 && q.empty());
+
+	q.set_mClock_merge(&hook, 8);
+	for (unsigned i = 0; i < 4000; i++) {
+		q.enqueue_mClock(0u, slo, 4096, write_op(0, i * 4096));
+		q.enqueue_mClock(1u, slo, 4096, write_op(1, i * 3 * 4096));
+	}
+	unsigned served[2] = { 0, 0 }, device_ops = 0;
+	while (served[0] + served[1] < 4000) {
+		WriteOp op = q.dequeue_mClock();
+		served[op.client] += op.len / 4096;
+		device_ops++;
+		assert(served[0] <= served[1] + 8 && served[1] <= served[0] + 8);
+	}
+	assert(device_ops < 2500);
+}
+
+// a retried request's refund moves its client's tags back to where
+// they were before the dispatch, by every request merged into it. then
+// a client whose requests keep needing a retry completes as much as
+// one whose do not; without the refund it is charged twice for those.
+static void test_requeue() {
+	WriteQueue q(100000, 10);
+	q.set_mClock_trace(false);
+	SequentialMerge hook;
+	q.set_mClock_merge(&hook, 4);
+	SLO slo;
+	slo.reserve = 1000;
+	slo.prop = 1;
+	slo.limit = 50000;
+	WriteQueue::ClientId c0 = q.intern_client(0);
+	for (int refund = 1; refund >= 0; refund--) {
+		for (unsigned i = 0; i < 4; i++)
+			q.enqueue_mClock(c0, slo, 4096, write_op(0, i * 4096));
+		for (unsigned i = 0; i < 4; i++)
+			q.enqueue_mClock(c0, slo, 4096, write_op(0, (100 + 2 * i) * 4096));
+		for (unsigned i = 0; i < 8; i++)
+			q.enqueue_mClock(1u, slo, 4096, write_op(1, i * 8192));
+		vector<int64_t> before = DMClockTestAccess::tags(q, c0);
+		WriteOp op;
+		WriteQueue::Charge charge;
+		do
+			op = q.dequeue_mClock(0, &charge);
+		while (op.client != 0);
+		assert(op.off == 0 && op.len == 16384 && charge.n == 4);
+		vector<int64_t> after = DMClockTestAccess::tags(q, c0);
+		assert(after != before);
+		q.requeue_mClock(c0, slo, 4096, op, refund ? &charge : NULL);
+		assert(DMClockTestAccess::tags(q, c0) == (refund ? before : after));
+		assert((charge.tag == -1) == (refund != 0));
+		do
+			op = q.dequeue_mClock();
+		while (op.client != 0);
+		assert(op.off == 0 && op.len == 16384);
+		while (!q.empty())
+			q.dequeue_mClock();
+	}
+
+	const unsigned ops = 30000;
+	for (int refund = 0; refund < 2; refund++) {
+		PrioritizedQueueDMClock<unsigned, unsigned> r(100000, 10);
+		r.set_mClock_trace(false);
+		slo.reserve = 0;
+		slo.limit = 0;
+		for (unsigned i = 0; i < ops; i++)
+			r.enqueue_mClock(i % 2, slo, 0, i);
+		vector<bool> retried(ops);
+		unsigned done[2] = { 0, 0 };
+		while (done[0] + done[1] < ops / 2) {
+			PrioritizedQueueDMClock<unsigned, unsigned>::Charge charge;
+			unsigned v = r.dequeue_mClock(0, &charge);
+			if (v % 6 == 0 && !retried[v]) {
+				retried[v] = true;
+				r.requeue_mClock(0u, slo, 0, v, refund ? &charge : NULL);
+				continue;
+			}
+			done[v % 2]++;
+		}
+		if (refund)
+			assert(done[0] + 1 >= done[1] && done[1] + 1 >= done[0]);
+		else
+			assert(done[0] * 5 < done[1] * 4);
+	}
+
+	// with two of a client's ops out, the one requeued gets back what
+	// it was charged, not what the later dispatch was
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	SLO rs, ps;
+	rs.reserve = 500;
+	rs.prop = 1;
+	rs.limit = 0;
+	ps.reserve = 0;
+	ps.prop = 1;
+	ps.limit = 0;
+	{
+		Q t(1000, 10);
+		t.set_mClock_trace(false);
+		Q::ClientId c = t.intern_client(0);
+		for (unsigned i = 0; i < 3; i++)
+			t.enqueue_mClock(c, rs, 0, 0);
+		vector<int64_t> before = DMClockTestAccess::tags(t, c);
+		// the first is due for its reservation, the second is not
+		Q::Charge a, b;
+		t.dequeue_mClock(0, &a);
+		t.dequeue_mClock(0, &b);
+		assert(a.tag != b.tag && b.n == 1);
+		t.requeue_mClock(c, rs, 0, 0, &a);
+		vector<int64_t> now = DMClockTestAccess::tags(t, c);
+		assert(now[0] == before[0] && now[1] == before[1]);
+	}
+
+	// a client's only op, requeued after running it dry, keeps its
+	// refund: its reservation is due again at once
+	for (int refund = 1; refund >= 0; refund--) {
+		Q t(1000, 10);
+		t.set_mClock_trace(false);
+		for (unsigned i = 0; i < 10; i++)
+			t.enqueue_mClock(1u, ps, 0, 1);
+		Q::ClientId c = t.intern_client(0);
+		t.enqueue_mClock(c, rs, 0, 0);
+		Q::Charge a;
+		assert(t.dequeue_mClock(0, &a) == 0 && !t.client_length(c));
+		t.requeue_mClock(c, rs, 0, 0, refund ? &a : NULL);
+		assert(DMClockTestAccess::reserve_due(t, c) == (refund != 0));
+		assert(t.dequeue_mClock() == 0);
+	}
+}
+
+// a client whose FIFO runs dry moves to cold storage and comes back
+// with the tags and SLO it left with; a new SLO waits for it to be
+// reclaimed. with a thousand clients taking turns to be busy, only the
+// busy ones hold schedule slots and each round is split by weight.
+static void test_cold() {
+	typedef PrioritizedQueueDMClock<unsigned, unsigned> Q;
+	Q q(1000, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 100;
+	slo.prop = 3;
+	slo.limit = 500;
+	Q::ClientId c = q.intern_client(5);
+	for (unsigned i = 0; i < 3; i++)
+		q.enqueue_mClock(c, slo, 0, 5);
+	SLO busy;
+	busy.reserve = 0;
+	busy.prop = 1;
+	busy.limit = 0;
+	for (unsigned i = 0; i < 100; i++)
+		q.enqueue_mClock(1u, busy, 0, 1);
+	vector<int64_t> hot = DMClockTestAccess::tags(q, c);
+	for (unsigned n = 0; n < 3;)
+		n += q.dequeue_mClock() == 5;
+	vector<int64_t> frozen = DMClockTestAccess::cold_tags(q, c);
+	assert(frozen != hot && DMClockTestAccess::hot(q) == 1);
+	assert(equal(frozen.begin() + 6, frozen.end(), hot.begin() + 6));
+	DMClockTestAccess::promote(q, c);
+	assert(DMClockTestAccess::tags(q, c) == frozen);
+	assert(DMClockTestAccess::hot(q) == 2);
+	SLO other = slo;
+	other.prop = 7;
+	q.enqueue_mClock(c, other, 0, 5);
+	vector<int64_t> back = DMClockTestAccess::tags(q, c);
+	assert(back[6] == 100 && back[7] == 3 && back[8] == 500);
+	for (unsigned i = 0; i < 6; i += 2)
+		assert(back[i] >= frozen[i]);
+
+	const unsigned clients = 1000, window = 100, rounds = 30, each = 30;
+	Q churn(100000, 10);
+	churn.set_mClock_trace(false);
+	SLO w[2];
+	w[0] = w[1] = busy;
+	w[1].prop = 2;
+	for (unsigned r = 0; r < rounds; r++) {
+		for (unsigned i = 0; i < window; i++) {
+			unsigned k = (r * window * 3 + i) % clients;
+			for (unsigned j = 0; j < each; j++)
+				churn.enqueue_mClock(k, w[k % 2], 0, k);
+		}
+		assert(DMClockTestAccess::hot(churn) == window);
+		unsigned served[2] = { 0, 0 };
+		for (unsigned i = 0; i < window * each / 2; i++)
+			served[churn.dequeue_mClock() % 2]++;
+		assert(served[1] > served[0] * 19 / 10 && served[1] < served[0] * 21 / 10);
+		while (!churn.empty())
+			churn.dequeue_mClock();
+		assert(DMClockTestAccess::hot(churn) == 0);
+	}
+}
+
+struct Test {
+	const char *name;
+	void (*run)();
+};
+
+static const Test tests[] = {
+	{ "checkpoint", test_checkpoint },
+	{ "reclaim", test_reclaim },
+	{ "wheel", test_wheel },
+	{ "fixed-point", test_fixed_point },
+	{ "refill", test_refill },
+	{ "bitmap", test_bitmap },
+	{ "depth", test_depth },
+	{ "admission", test_admission },
+	{ "remove", test_remove },
+	{ "cancel", test_cancel },
+	{ "policy", test_policy },
+	{ "numa", test_numa },
+	{ "steal", test_steal },
+	{ "intake", test_intake },
+	{ "idle", test_idle },
+	{ "clock", test_clock },
+	{ "utime", test_utime },
+	{ "drr", test_drr },
+	{ "join", test_join },
+	{ "intern", test_intern },
+	{ "devices", test_devices },
+	{ "window", test_window },
+	{ "merge", test_merge },
+	{ "requeue", test_requeue },
+	{ "cold", test_cold },
+};
+
+// test-<name> runs one test, test all of them
+static int run_tests(const string &mode) {
+	int ran = 0;
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		if (mode != "test" && mode != string("test-") + tests[i].name)
+			continue;
+		tests[i].run();
+		cout << "test-" << tests[i].name << " ok" << endl;
+		ran++;
+	}
+	if (!ran)
+		cerr << "no test " << mode << endl;
+	return ran ? 0 : 1;
+}
+
+// idle clients are checkpointed and restored into a fresh queue. a
+// restore builds the client tables in one pass, so it should cost
+// little more than the memory they take: we require under 1us per
+// client, i.e. a million clients in well under a second.
+static int bench_restore(unsigned clients) {
+	const char *path = "/tmp/PriorityQueueTest.ckpt";
+	const char *again = "/tmp/PriorityQueueTest.ckpt.2";
+	PrioritizedQueueDMClock<unsigned, unsigned> q(100000, 10);
+	q.set_mClock_trace(false);
+	SLO slo;
+	slo.reserve = 0;
+	slo.prop = 1;
+	slo.limit = 0;
+	for (unsigned c = 0; c < clients; c++) {
+		q.enqueue_mClock(c, slo, 0, c);
+		q.dequeue_mClock();
+	}
+	assert(q.checkpoint_mClock(path) == 0);
+
+	PrioritizedQueueDMClock<unsigned, unsigned> r(100000, 10);
+	r.set_mClock_trace(false);
+	double start = now_sec();
+	int ret = r.restore_mClock(path);
+	double elapsed = now_sec() - start;
+	assert(ret == 0);
+	assert(r.restore_mClock(path) == -EBUSY);
+
+	// every client came back: saving again writes as many records
+	assert(r.checkpoint_mClock(again) == 0);
+	struct stat a, b;
+	assert(stat(path, &a) == 0 && stat(again, &b) == 0);
+	assert(a.st_size == b.st_size);
+	unlink(path);
+	unlink(again);
+
+	double ns = elapsed * 1e9 / clients;
+	cout << clients << " clients: restore " << elapsed * 1e3 << " ms, " << ns
+			<< " ns/client" << endl;
+	assert(ns < 1000);
+	return 0;
+}
+
 int main(int argc, char* argv[]) {
 
+	// PriorityQueueTest test[-name]
+	if (argc > 1 && string(argv[1]).compare(0, 4, "test") == 0)
+		return run_tests(argv[1]);
+
+	// PriorityQueueTest bench-policy [clients]
+	if (argc > 1 && string(argv[1]) == "bench-policy")
+		return bench_policy(argc > 2 ? atoi(argv[2]) : 20000);
+	// PriorityQueueTest bench-numa [nodes] [producers]; 0 nodes means
+	// use the real topology when there is more than one node
+	if (argc > 1 && string(argv[1]) == "bench-numa")
+		return bench_numa(argc > 2 ? atoi(argv[2]) : 0,
+				argc > 3 ? atoi(argv[3]) : 8);
+	// PriorityQueueTest bench-steal [workers]
+	if (argc > 1 && string(argv[1]) == "bench-steal")
+		return bench_steal(argc > 2 ? atoi(argv[2]) : 4);
+	// PriorityQueueTest bench-intake [producers]
+	if (argc > 1 && string(argv[1]) == "bench-intake")
+		return bench_intake(argc > 2 ? atoi(argv[2]) : 4);
+	// PriorityQueueTest bench-idle
+	if (argc > 1 && string(argv[1]) == "bench-idle")
+		return bench_idle();
+	// PriorityQueueTest bench-clock
+	if (argc > 1 && string(argv[1]) == "bench-clock")
+		return bench_clock();
+	// PriorityQueueTest bench-utime
+	if (argc > 1 && string(argv[1]) == "bench-utime")
+		return bench_utime();
+	// PriorityQueueTest bench-drr [classes]
+	if (argc > 1 && string(argv[1]) == "bench-drr")
+		return bench_drr(argc > 2 ? atoi(argv[2]) : 10000);
+	// PriorityQueueTest bench-join
+	if (argc > 1 && string(argv[1]) == "bench-join")
+		return bench_join();
+	// PriorityQueueTest bench-intern [clients]
+	if (argc > 1 && string(argv[1]) == "bench-intern")
+		return bench_intern(argc > 2 ? atoi(argv[2]) : 100);
+	// PriorityQueueTest bench-devices
+	if (argc > 1 && string(argv[1]) == "bench-devices")
+		return bench_devices();
+	// PriorityQueueTest bench-window
+	if (argc > 1 && string(argv[1]) == "bench-window")
+		return bench_window();
+	// PriorityQueueTest bench-merge
+	if (argc > 1 && string(argv[1]) == "bench-merge")
+		return bench_merge();
+	// PriorityQueueTest bench-requeue
+	if (argc > 1 && string(argv[1]) == "bench-requeue")
+		return bench_requeue();
+	// PriorityQueueTest bench-cold
+	if (argc > 1 && string(argv[1]) == "bench-cold")
+		return bench_cold();
+	// PriorityQueueTest bench-restore [clients]
+	if (argc > 1 && string(argv[1]) == "bench-restore")
+		return bench_restore(argc > 2 ? atoi(argv[2]) : 1000000);
+
 //	CephContext* cct = NULL;
 //	utime_t now = ceph_clock_now(cct);
 //	double_t space = 10.5f;
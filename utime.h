@@ -18,6 +18,7 @@
 #include <math.h>
 #include <sys/time.h>
 #include <time.h>
+#include <string.h>
 #include "/usr/include/errno.h"
 
 #include "types.h"
@@ -149,33 +150,132 @@ public:
     nanosleep(&ts, NULL);
   }
 
-  // output
-  ostream& gmtime(ostream& out) const {
-    out.setf(std::ios::right);
-    char oldfill = out.fill();
-    out.fill('0');
+  // proleptic gregorian calendar <-> days since the epoch, so that
+  // formatting and parsing UTC needs neither gmtime_r nor timegm.
+  static int64_t days_from_civil(int y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+  }
+  static void civil_from_days(int64_t z, int *y, unsigned *m, unsigned *d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (int)(yoe + era * 400) + (*m <= 2);
+  }
+
+  static char *put_digits(char *p, unsigned v, int width) {
+    for (int i = width - 1; i >= 0; --i) {
+      p[i] = '0' + v % 10;
+      v /= 10;
+    }
+    return p + width;
+  }
+
+  // "YYYY-MM-DD HH:MM:SS" (19 chars) for sec(), in UTC or local
+  // time. the result for the last second seen is cached per thread,
+  // so a trace printing many lines a second only pays for it once.
+  void format_seconds(char *out, bool local) const {
+    struct cache_t {
+      time_t sec;
+      char buf[19];
+      bool valid;
+    };
+    static __thread cache_t cache[2];
+    cache_t &c = cache[local];
+    time_t tt = sec();
+    if (!c.valid || c.sec != tt) {
+      int y;
+      unsigned mon, mday, hour, min, s;
+      if (local) {
+	struct tm bdt;
+	localtime_r(&tt, &bdt);
+	y = bdt.tm_year + 1900;
+	mon = bdt.tm_mon + 1;
+	mday = bdt.tm_mday;
+	hour = bdt.tm_hour;
+	min = bdt.tm_min;
+	s = bdt.tm_sec;
+      } else {
+	civil_from_days(tt / 86400, &y, &mon, &mday);
+	unsigned sod = tt % 86400;
+	hour = sod / 3600;
+	min = sod / 60 % 60;
+	s = sod % 60;
+      }
+      char *p = put_digits(c.buf, y, 4);
+      *p++ = '-';
+      p = put_digits(p, mon, 2);
+      *p++ = '-';
+      p = put_digits(p, mday, 2);
+      *p++ = ' ';
+      p = put_digits(p, hour, 2);
+      *p++ = ':';
+      p = put_digits(p, min, 2);
+      *p++ = ':';
+      put_digits(p, s, 2);
+      c.sec = tt;
+      c.valid = true;
+    }
+    memcpy(out, c.buf, sizeof(c.buf));
+  }
+
+  // same text as the ostream gmtime()/localtime() below, written to a
+  // caller buffer without allocating. returns the length, or -ERANGE
+  // (and an empty string, if there is room for one) when outlen is
+  // too short.
+  int format(char *out, int outlen, bool local) const {
+    char buf[32];
+    char *p = buf;
     if (sec() < ((time_t)(60*60*24*365*10))) {
       // raw seconds.  this looks like a relative time.
-      out << (long)sec() << "." << std::setw(6) << usec();
+      char digits[10];
+      char *d = digits + sizeof(digits);
+      unsigned long v = sec();
+      do {
+	*--d = '0' + v % 10;
+	v /= 10;
+      } while (v);
+      memcpy(p, d, digits + sizeof(digits) - d);
+      p += digits + sizeof(digits) - d;
     } else {
-      // localtime.  this looks like an absolute time.
-      //  aim for http://en.wikipedia.org/wiki/ISO_8601
-      struct tm bdt;
-      time_t tt = sec();
-      gmtime_r(&tt, &bdt);
-      out << std::setw(4) << (bdt.tm_year+1900)  // 2007 -> '07'
-	  << '-' << std::setw(2) << (bdt.tm_mon+1)
-	  << '-' << std::setw(2) << bdt.tm_mday
-	  << ' '
-	  << std::setw(2) << bdt.tm_hour
-	  << ':' << std::setw(2) << bdt.tm_min
-	  << ':' << std::setw(2) << bdt.tm_sec;
-      out << "." << std::setw(6) << usec();
-      out << "Z";
+      format_seconds(p, local);
+      p += 19;
     }
-    out.fill(oldfill);
-    out.unsetf(std::ios::right);
-    return out;
+    *p++ = '.';
+    p = put_digits(p, usec(), 6);
+    if (!local && sec() >= ((time_t)(60*60*24*365*10)))
+      *p++ = 'Z';
+    int len = p - buf;
+    if (len >= outlen) {
+      if (outlen > 0)
+	out[0] = '\0';
+      return -ERANGE;
+    }
+    memcpy(out, buf, len);
+    out[len] = '\0';
+    return len;
+  }
+  int gmtime(char *out, int outlen) const {
+    return format(out, outlen, false);
+  }
+  int localtime(char *out, int outlen) const {
+    return format(out, outlen, true);
+  }
+
+  // output
+  ostream& gmtime(ostream& out) const {
+    char buf[32];
+    int len = format(buf, sizeof(buf), false);
+    return out.write(buf, len);
   }
 
   // output
@@ -206,46 +306,80 @@ public:
   }
   
   ostream& localtime(ostream& out) const {
-    out.setf(std::ios::right);
-    char oldfill = out.fill();
-    out.fill('0');
-    if (sec() < ((time_t)(60*60*24*365*10))) {
-      // raw seconds.  this looks like a relative time.
-      out << (long)sec() << "." << std::setw(6) << usec();
-    } else {
-      // localtime.  this looks like an absolute time.
-      //  aim for http://en.wikipedia.org/wiki/ISO_8601
-      struct tm bdt;
-      time_t tt = sec();
-      localtime_r(&tt, &bdt);
-      out << std::setw(4) << (bdt.tm_year+1900)  // 2007 -> '07'
-	  << '-' << std::setw(2) << (bdt.tm_mon+1)
-	  << '-' << std::setw(2) << bdt.tm_mday
-	  << ' '
-	  << std::setw(2) << bdt.tm_hour
-	  << ':' << std::setw(2) << bdt.tm_min
-	  << ':' << std::setw(2) << bdt.tm_sec;
-      out << "." << std::setw(6) << usec();
-      //out << '_' << bdt.tm_zone;
-    }
-    out.fill(oldfill);
-    out.unsetf(std::ios::right);
-    return out;
+    char buf[32];
+    int len = format(buf, sizeof(buf), true);
+    return out.write(buf, len);
   }
 
   int sprintf(char *out, int outlen) const {
-    struct tm bdt;
-    time_t tt = sec();
-    localtime_r(&tt, &bdt);
+    char buf[27];
+    format_seconds(buf, true);
+    buf[19] = '.';
+    put_digits(buf + 20, usec(), 6);
+    buf[26] = '\0';
+    if (outlen > 0) {
+      int n = outlen - 1 < 26 ? outlen - 1 : 26;
+      memcpy(out, buf, n);
+      out[n] = '\0';
+    }
+    return 26;
+  }
 
-    return snprintf(out, outlen,
-		    "%04d-%02d-%02d %02d:%02d:%02d.%06ld",
-		    bdt.tm_year + 1900, bdt.tm_mon + 1, bdt.tm_mday,
-		    bdt.tm_hour, bdt.tm_min, bdt.tm_sec, usec());
+  static const char *parse_uint(const char *p, int width, unsigned *v) {
+    *v = 0;
+    for (int i = 0; i < width; i++, p++) {
+      if (*p < '0' || *p > '9')
+	return NULL;
+      *v = *v * 10 + (*p - '0');
+    }
+    return p;
+  }
+
+  // "YYYY-MM-DD[( |T)HH:MM:SS[.fraction]][Z]", as UTC. digits past
+  // nanoseconds are ignored. returns -EINVAL for anything else,
+  // including out of range fields; never allocates.
+  static int parse_iso8601(const char *p, uint64_t *epoch, uint64_t *nsec) {
+    unsigned y, mon, mday, hour = 0, min = 0, s = 0, ns = 0;
+    if (!(p = parse_uint(p, 4, &y)) || *p++ != '-' ||
+	!(p = parse_uint(p, 2, &mon)) || *p++ != '-' ||
+	!(p = parse_uint(p, 2, &mday)))
+      return -EINVAL;
+    if (*p == ' ' || *p == 'T') {
+      ++p;
+      if (!(p = parse_uint(p, 2, &hour)) || *p++ != ':' ||
+	  !(p = parse_uint(p, 2, &min)) || *p++ != ':' ||
+	  !(p = parse_uint(p, 2, &s)))
+	return -EINVAL;
+      if (*p == '.') {
+	++p;
+	if (*p < '0' || *p > '9')
+	  return -EINVAL;
+	unsigned scale = 100000000;
+	for (; *p >= '0' && *p <= '9'; ++p, scale /= 10)
+	  ns += (*p - '0') * scale;
+      }
+    }
+    if (*p == 'Z')
+      ++p;
+    if (*p || mon < 1 || mon > 12 || mday < 1 || mday > 31 ||
+	hour > 23 || min > 59 || s > 59)
+      return -EINVAL;
+    if (epoch)
+      *epoch = days_from_civil(y, mon, mday) * 86400 +
+	hour * 3600 + min * 60 + s;
+    if (nsec)
+      *nsec = ns;
+    return 0;
   }
 
   static int parse_date(const string& date, uint64_t *epoch, uint64_t *nsec,
                         string *out_date=NULL, string *out_time=NULL) {
+    // the canonical forms don't need strptime. the 'T' form goes the
+    // slow way, which reads only its date.
+    if (!out_date && !out_time && date.find('T') == string::npos &&
+	parse_iso8601(date.c_str(), epoch, nsec) == 0)
+      return 0;
+
     struct tm tm;
     memset(&tm, 0, sizeof(tm));
 